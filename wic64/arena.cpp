@@ -0,0 +1,107 @@
+#include <cstdlib>
+#include "esp_log.h"
+
+#include "arena.h"
+
+namespace WiC64 {
+    const char* Arena::TAG = "ARENA";
+
+    portMUX_TYPE Arena::mutex = portMUX_INITIALIZER_UNLOCKED;
+
+    void* Arena::allocate(size_t size) {
+        void *ptr = NULL;
+
+        // keep allocations aligned to 8 bytes
+        size = (size + 7) & ~((size_t) 7);
+
+        portENTER_CRITICAL(&mutex);
+        if (m_used + size <= WIC64_ARENA_SIZE) {
+            ptr = m_memory + m_used;
+            m_used += size;
+            m_live++;
+            m_allocations++;
+
+            if (m_used > m_highWaterMark) {
+                m_highWaterMark = m_used;
+            }
+        }
+        portEXIT_CRITICAL(&mutex);
+
+        if (ptr != NULL) {
+            return ptr;
+        }
+
+        ESP_LOGW(TAG, "Arena exhausted, allocating %d bytes on the heap", size);
+
+        portENTER_CRITICAL(&mutex);
+        m_heapAllocations++;
+        portEXIT_CRITICAL(&mutex);
+
+        if ((ptr = malloc(size)) == NULL) {
+            ESP_LOGE(TAG, "Could not allocate %d bytes", size);
+        }
+        return ptr;
+    }
+
+    void Arena::free(void* ptr) {
+        if (ptr == NULL) {
+            return;
+        }
+
+        if (!contains(ptr)) {
+            ::free(ptr);
+            return;
+        }
+
+        portENTER_CRITICAL(&mutex);
+        // Nothing is left in the arena, so it can be reused right away.
+        // This also recovers from resets that had to be deferred.
+        if (--m_live == 0) {
+            m_used = 0;
+        }
+        portEXIT_CRITICAL(&mutex);
+    }
+
+    bool Arena::contains(void* ptr) {
+        return ptr >= (void*) m_memory && ptr < (void*) (m_memory + WIC64_ARENA_SIZE);
+    }
+
+    void Arena::reset(void) {
+        uint32_t live;
+        uint32_t used;
+
+        portENTER_CRITICAL(&mutex);
+        live = m_live;
+        used = m_used;
+        m_requests++;
+
+        if (live == 0) {
+            m_used = 0;
+        } else {
+            m_deferredResets++;
+        }
+        portEXIT_CRITICAL(&mutex);
+
+        if (live > 0) {
+            ESP_LOGW(TAG, "Deferring arena reset, %d objects still in use", live);
+            return;
+        }
+        ESP_LOGD(TAG, "Resetting arena, %d of %d bytes used", used, WIC64_ARENA_SIZE);
+    }
+
+    String Arena::statistics(void) {
+        char statistics[192];
+
+        snprintf(statistics, sizeof(statistics),
+            "Request arena: %d bytes, max %d bytes used, %d allocations "
+            "for %d requests, %d heap allocations, %d deferred resets",
+            WIC64_ARENA_SIZE,
+            m_highWaterMark,
+            m_allocations,
+            m_requests,
+            m_heapAllocations,
+            m_deferredResets);
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef WIC64_ARENA_H
+#define WIC64_ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include "freertos/FreeRTOS.h"
+#include "WString.h"
+
+#define WIC64_ARENA_SIZE 2048
+
+namespace WiC64 {
+
+    /* Bump allocator for the objects created while servicing a single
+     * request (Request, Command and Data). Deleting an object allocated
+     * from the arena does not free its memory, the whole arena is reset
+     * once the request has been finalized and all of its objects have
+     * been deleted. If an object outlives the request, the reset is
+     * deferred until the last object has been deleted.
+     *
+     * Objects are created and deleted from both the userport dispatcher
+     * and worker tasks, so all accesses are serialized.
+     *
+     * If the arena is exhausted, memory is allocated on the heap
+     * instead. This is counted, in the steady state the request path
+     * should not allocate any heap memory at all.
+     */
+    class Arena {
+        public:
+            static const char* TAG;
+
+        private:
+            static portMUX_TYPE mutex;
+
+            uint8_t m_memory[WIC64_ARENA_SIZE] __attribute__((aligned(8)));
+            uint32_t m_used = 0;
+            uint32_t m_live = 0;
+
+            uint32_t m_highWaterMark = 0;
+            uint32_t m_allocations = 0;
+            uint32_t m_heapAllocations = 0;
+            uint32_t m_requests = 0;
+            uint32_t m_deferredResets = 0;
+
+        public:
+            void* allocate(size_t size);
+            void free(void* ptr);
+            bool contains(void* ptr);
+
+            void reset(void);
+
+            uint32_t used(void) { return m_used; }
+            uint32_t heapAllocations(void) { return m_heapAllocations; }
+            String statistics(void);
+    };
+
+    extern Arena *arena;
+}
+
+/* Routes new and delete for a class and its subclasses through the
+ * request arena, see Arena above. */
+#define WIC64_ARENA_ALLOCATED \
+    static void* operator new(size_t size) { return ::WiC64::arena->allocate(size); } \
+    static void operator delete(void* ptr) { ::WiC64::arena->free(ptr); }
+
+#endif // WIC64_ARENA_H
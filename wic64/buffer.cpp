@@ -0,0 +1,114 @@
+#include <cstdlib>
+#include "esp_log.h"
+
+#include "buffer.h"
+#include "utilities.h"
+
+namespace WiC64 {
+    const char* BufferPool::TAG = "BUFFER";
+
+    extern BufferPool *bufferPool;
+
+    portMUX_TYPE BufferPool::mutex = portMUX_INITIALIZER_UNLOCKED;
+
+    Buffer* Buffer::retain(void) {
+        portENTER_CRITICAL(&BufferPool::mutex);
+        m_references++;
+        portEXIT_CRITICAL(&BufferPool::mutex);
+        return this;
+    }
+
+    void Buffer::release(void) {
+        bool unused;
+
+        portENTER_CRITICAL(&BufferPool::mutex);
+        unused = (--m_references == 0);
+        portEXIT_CRITICAL(&BufferPool::mutex);
+
+        if (unused) {
+            bufferPool->reclaim(this);
+        }
+    }
+
+    BufferPool::BufferPool() {
+        for (uint8_t i=0; i<WIC64_BUFFER_POOL_SIZE; i++) {
+            m_buffers[i].m_data = (uint8_t*) calloc(WIC64_BUFFER_SIZE, sizeof(uint8_t));
+
+            if (m_buffers[i].m_data == NULL) {
+                ESP_LOGE(TAG, "Fatal: could not allocate transfer buffer %d", i);
+            }
+        }
+        ESP_LOGI(TAG, "Allocated %d transfer buffers of %d bytes",
+            WIC64_BUFFER_POOL_SIZE, WIC64_BUFFER_SIZE);
+    }
+
+    Buffer* BufferPool::acquire(void) {
+        Buffer *buffer = NULL;
+
+        portENTER_CRITICAL(&mutex);
+        for (uint8_t i=0; i<WIC64_BUFFER_POOL_SIZE; i++) {
+            if (m_buffers[i].m_references == 0 && m_buffers[i].m_data != NULL) {
+                buffer = &m_buffers[i];
+                buffer->m_references = 1;
+
+                m_acquired++;
+                m_inUse++;
+                m_highWaterMark = MAX(m_highWaterMark, m_inUse);
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&mutex);
+
+        if (buffer != NULL) {
+            return buffer;
+        }
+
+        ESP_LOGE(TAG, "Transfer buffer pool exhausted (%d in use), allocating buffer on the heap",
+            m_inUse);
+
+        buffer = new Buffer();
+        buffer->m_pooled = false;
+        buffer->m_references = 1;
+        buffer->m_data = (uint8_t*) malloc(WIC64_BUFFER_SIZE);
+
+        if (buffer->m_data == NULL) {
+            ESP_LOGE(TAG, "Could not allocate transfer buffer on the heap");
+            delete buffer;
+            m_failures++;
+            return NULL;
+        }
+        m_overflows++;
+
+        return buffer;
+    }
+
+    void BufferPool::reclaim(Buffer *buffer) {
+        if (!buffer->m_pooled) {
+            free(buffer->m_data);
+            delete buffer;
+            return;
+        }
+
+        portENTER_CRITICAL(&mutex);
+        m_inUse--;
+        portEXIT_CRITICAL(&mutex);
+    }
+
+    String BufferPool::statistics(void) {
+        char statistics[192];
+
+        snprintf(statistics, sizeof(statistics),
+            "Transfer buffers: %d x %d bytes, %d in use, max %d in use, "
+            "%d acquired, %d failures (%d pool exhausted, %d out of memory)",
+            WIC64_BUFFER_POOL_SIZE,
+            WIC64_BUFFER_SIZE,
+            m_inUse,
+            m_highWaterMark,
+            m_acquired,
+            m_overflows + m_failures,
+            m_overflows,
+            m_failures);
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef WIC64_BUFFER_H
+#define WIC64_BUFFER_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "WString.h"
+
+#include "wic64.h"
+
+namespace WiC64 {
+
+    /* A transfer buffer of WIC64_BUFFER_SIZE bytes, shared by reference
+     * counting. Buffers are taken from the BufferPool with a reference
+     * count of one, every retain() must be matched by a release(). The
+     * buffer returns to the pool once the last reference is released.
+     */
+    class Buffer {
+        friend class BufferPool;
+
+        private:
+            uint8_t *m_data = NULL;
+            uint32_t m_references = 0;
+            bool m_pooled = true;
+
+        public:
+            uint8_t* data(void) { return m_data; }
+            uint32_t references(void) { return m_references; }
+
+            Buffer* retain(void);
+            void release(void);
+    };
+
+    /* Fixed pool of WIC64_BUFFER_POOL_SIZE buffers allocated once at
+     * boot. If the pool is exhausted, a buffer is allocated on the heap
+     * and freed again once released. This should never happen and is
+     * reported as a failure, since it fragments the heap.
+     */
+    class BufferPool {
+        friend class Buffer;
+
+        public:
+            static const char* TAG;
+
+        private:
+            static portMUX_TYPE mutex;
+
+            Buffer m_buffers[WIC64_BUFFER_POOL_SIZE];
+
+            uint8_t m_inUse = 0;
+            uint8_t m_highWaterMark = 0;
+            uint32_t m_acquired = 0;
+            uint32_t m_overflows = 0;
+            uint32_t m_failures = 0;
+
+            void reclaim(Buffer *buffer);
+
+        public:
+            BufferPool();
+
+            Buffer* acquire(void);
+            String statistics(void);
+    };
+}
+
+#endif // WIC64_BUFFER_H
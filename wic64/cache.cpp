@@ -0,0 +1,210 @@
+#include <cstdlib>
+#include <cstring>
+#include "esp_log.h"
+#include "esp32-hal.h"
+
+#include "cache.h"
+
+namespace WiC64 {
+    const char* ResponseCache::TAG = "CACHE";
+
+    ResponseCache::ResponseCache() {
+        for (uint8_t i=0; i<WIC64_CACHE_ENTRIES; i++) {
+            m_entries[i].body = NULL;
+            m_entries[i].size = 0;
+        }
+    }
+
+    int32_t ResponseCache::maxAge(const char* cacheControl, bool *noStore) {
+        const char *directive;
+        int32_t seconds;
+
+        *noStore = false;
+
+        if (cacheControl == NULL || cacheControl[0] == '\0') {
+            return -1;
+        }
+
+        if (strcasestr(cacheControl, "no-store") != NULL) {
+            *noStore = true;
+            return -1;
+        }
+
+        if (strcasestr(cacheControl, "no-cache") != NULL) {
+            return -1;
+        }
+
+        if ((directive = strcasestr(cacheControl, "max-age=")) == NULL) {
+            return -1;
+        }
+
+        // more than 24 days would overflow the millisecond value
+        seconds = atoi(directive + strlen("max-age="));
+        return (seconds > 0 && seconds < 0x200000) ? seconds * 1000 : -1;
+    }
+
+    ResponseCache::entry_t* ResponseCache::find(const char* url) {
+        for (uint8_t i=0; i<WIC64_CACHE_ENTRIES; i++) {
+            if (m_entries[i].body != NULL && m_entries[i].url == url) {
+                return &m_entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    ResponseCache::entry_t* ResponseCache::freeEntry(void) {
+        for (uint8_t i=0; i<WIC64_CACHE_ENTRIES; i++) {
+            if (m_entries[i].body == NULL) {
+                return &m_entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    ResponseCache::entry_t* ResponseCache::leastRecentlyUsed(void) {
+        entry_t *entry = NULL;
+
+        for (uint8_t i=0; i<WIC64_CACHE_ENTRIES; i++) {
+            if (m_entries[i].body != NULL && (entry == NULL || m_entries[i].timeUsed < entry->timeUsed)) {
+                entry = &m_entries[i];
+            }
+        }
+        return entry;
+    }
+
+    ResponseCache::entry_t* ResponseCache::lookup(const char* url) {
+        entry_t *entry;
+
+        if ((entry = find(url)) == NULL) {
+            m_misses++;
+        }
+        return entry;
+    }
+
+    bool ResponseCache::isFresh(entry_t *entry) {
+        return entry->maxAge >= 0 && millis() - entry->timeStored < (uint32_t) entry->maxAge;
+    }
+
+    void ResponseCache::serve(entry_t *entry, Data *response) {
+        if (isFresh(entry)) {
+            m_hits++;
+        } else {
+            m_revalidations++;
+        }
+        m_bytesSaved += entry->size;
+        entry->timeUsed = millis();
+
+        memcpy(response->data(), entry->body, entry->size);
+        response->size(entry->size);
+
+        ESP_LOGI(TAG, "Serving %d bytes from cache", entry->size);
+    }
+
+    void ResponseCache::revalidated(entry_t *entry, const char* cacheControl) {
+        bool noStore;
+
+        // A 304 response may update the freshness of the stored response
+        if (cacheControl != NULL && cacheControl[0] != '\0') {
+            entry->maxAge = maxAge(cacheControl, &noStore);
+        }
+        entry->timeStored = millis();
+    }
+
+    bool ResponseCache::isCacheable(uint32_t size,
+        const char* etag, const char* lastModified, const char* cacheControl) {
+
+        int32_t age;
+        bool noStore;
+
+        age = maxAge(cacheControl, &noStore);
+
+        if (noStore || size == 0 || size > WIC64_CACHE_MEMORY) {
+            return false;
+        }
+
+        // Responses that are never fresh and can't be revalidated are useless
+        return age >= 0 || etag[0] != '\0' || lastModified[0] != '\0';
+    }
+
+    void ResponseCache::store(const char* url, Data *response,
+        const char* etag, const char* lastModified, const char* cacheControl) {
+
+        entry_t *entry;
+        uint8_t *body;
+        int32_t age;
+        bool noStore;
+
+        if (!isCacheable(response->size(), etag, lastModified, cacheControl)) {
+            return;
+        }
+        age = maxAge(cacheControl, &noStore);
+
+        if ((entry = find(url)) != NULL) {
+            remove(entry);
+        }
+
+        // Evict least recently used responses until the response fits
+        while ((entry = freeEntry()) == NULL || m_memory + response->size() > WIC64_CACHE_MEMORY) {
+            entry = leastRecentlyUsed();
+
+            ESP_LOGD(TAG, "Evicting %s", entry->url.c_str());
+            remove(entry);
+            m_evictions++;
+        }
+
+        if ((body = (uint8_t*) malloc(response->size())) == NULL) {
+            ESP_LOGW(TAG, "Could not allocate %d bytes for response", response->size());
+            return;
+        }
+        memcpy(body, response->data(), response->size());
+
+        entry->url = url;
+        entry->body = body;
+        entry->size = response->size();
+        entry->etag = etag;
+        entry->lastModified = lastModified;
+        entry->timeStored = millis();
+        entry->timeUsed = millis();
+        entry->maxAge = age;
+
+        m_memory += entry->size;
+        m_stores++;
+
+        ESP_LOGD(TAG, "Stored %d bytes (%s)", entry->size, url);
+    }
+
+    void ResponseCache::remove(entry_t *entry) {
+        m_memory -= entry->size;
+
+        free(entry->body);
+        entry->body = NULL;
+        entry->size = 0;
+        entry->url = "";
+        entry->etag = "";
+        entry->lastModified = "";
+    }
+
+    String ResponseCache::statistics(void) {
+        char statistics[200];
+        uint8_t entries = 0;
+
+        for (uint8_t i=0; i<WIC64_CACHE_ENTRIES; i++) {
+            if (m_entries[i].body != NULL) entries++;
+        }
+
+        snprintf(statistics, sizeof(statistics),
+            "Response cache: %d hits, %d revalidated, %d misses, %d stored, %d evicted, "
+            "%llu bytes saved, %d of %d bytes used by %d responses",
+            m_hits,
+            m_revalidations,
+            m_misses,
+            m_stores,
+            m_evictions,
+            m_bytesSaved,
+            m_memory,
+            WIC64_CACHE_MEMORY,
+            entries);
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef WIC64_CACHE_H
+#define WIC64_CACHE_H
+
+#include <cstdint>
+#include "WString.h"
+
+#include "data.h"
+
+#define WIC64_CACHE_MEMORY 0x8000
+#define WIC64_CACHE_ENTRIES 8
+
+namespace WiC64 {
+
+    /* In-memory LRU cache for responses to HTTP GET requests, keyed by
+     * the expanded URL, so that URLs containing the MAC address and
+     * security token of this device are never shared with other URLs.
+     *
+     * Responses are only stored if they are fresh for some time
+     * according to Cache-Control: max-age, or if they can be revalidated
+     * using their ETag or Last-Modified header. The cache holds up to
+     * WIC64_CACHE_MEMORY bytes of response bodies in total.
+     */
+    class ResponseCache {
+        public:
+            static const char* TAG;
+
+            typedef struct {
+                String url;
+                uint8_t *body;
+                uint32_t size;
+                String etag;
+                String lastModified;
+                uint32_t timeStored;
+                uint32_t timeUsed;
+                int32_t maxAge; // ms, -1 if the response must be revalidated
+            } entry_t;
+
+        private:
+            entry_t m_entries[WIC64_CACHE_ENTRIES];
+            uint32_t m_memory = 0;
+
+            uint32_t m_hits = 0;
+            uint32_t m_revalidations = 0;
+            uint32_t m_misses = 0;
+            uint32_t m_stores = 0;
+            uint32_t m_evictions = 0;
+            uint64_t m_bytesSaved = 0;
+
+            entry_t* find(const char* url);
+            entry_t* freeEntry(void);
+            entry_t* leastRecentlyUsed(void);
+            void remove(entry_t *entry);
+
+        public:
+            ResponseCache();
+
+            static int32_t maxAge(const char* cacheControl, bool *noStore);
+            static bool isCacheable(uint32_t size,
+                const char* etag, const char* lastModified, const char* cacheControl);
+
+            entry_t* lookup(const char* url);
+            bool isFresh(entry_t *entry);
+
+            void serve(entry_t *entry, Data *response);
+            void revalidated(entry_t *entry, const char* cacheControl);
+            void store(const char* url, Data *response,
+                const char* etag, const char* lastModified, const char* cacheControl);
+
+            String statistics(void);
+    };
+
+    extern ResponseCache *responseCache;
+}
+
+#endif // WIC64_CACHE_H
@@ -5,6 +5,7 @@
 
 namespace WiC64 {
     typedef void (*callback_t) (uint8_t* data, uint32_t size);
+    typedef bool (*provider_t) (uint8_t** data, uint32_t* size);
 }
 
 #endif //WIC64_CALLBACK_H
\ No newline at end of file
@@ -1,8 +1,8 @@
 #include "command.h"
 #include "commands/commands.h"
 #include "service.h"
+#include "worker.h"
 
-#include "esp_event.h"
 
 namespace WiC64 {
     const char* Command::TAG = "COMMAND";
@@ -36,15 +36,15 @@ namespace WiC64 {
 
     void Command::execute(Command *command) {
         if (command->request()->payload()->isQueued()) {
-            xTaskCreatePinnedToCore(commandTask, "COMMAND", 4096, command, 20, NULL, 1);
+            // If no worker is available, the queued transfer will time out
+            workers->submit("COMMAND", commandJob, command);
         } else {
             command->execute();
         }
     }
 
-    void Command::commandTask(void *command) {
+    void Command::commandJob(void *command) {
         ((Command*) command)->execute();
-        vTaskDelete(NULL);
     }
 
     void Command::status(uint8_t code, const char *message, const char* legacy_message) {
@@ -78,21 +78,30 @@ namespace WiC64 {
         return m_request->protocol()->id() == Protocol::EXTENDED;
     }
 
+    bool Command::canStreamResponse(uint32_t size) {
+        // The standard protocol sends the size of the response in the
+        // header before any data, so a queued response of known length
+        // below 64kb can be sent as well. Only legacy clients expect
+        // the response to be sent from the transfer buffer.
+        return supportsQueuedResponse() || (!isLegacyRequest() && size < 0x10000);
+    }
+
     const char *Command::describe() {
         return "Generic command (no description available)";
     }
 
+    void Command::prepare(void) {
+        // Called as soon as the request header has been received,
+        // while the payload is still being transferred
+    }
+
     void Command::execute(void) {
         responseReady();
     }
 
     void Command::responseReady() {
         ESP_LOGD(TAG, "Posting SERVICE_RESPONSE_READY event");
-        esp_event_post_to(
-            service->eventLoop(),
-            SERVICE_EVENTS,
-            SERVICE_RESPONSE_READY,
-            NULL, 0, 0);
+        service->dispatcher()->post(SERVICE_RESPONSE_READY);
 
         m_response_ready = true;
     }
@@ -6,6 +6,7 @@
 #include "wic64.h"
 #include "service.h"
 #include "protocol.h"
+#include "arena.h"
 
 namespace WiC64 {
     class Command {
@@ -20,6 +21,7 @@ namespace WiC64 {
 
         public:
             const static char* TAG;
+            WIC64_ARENA_ALLOCATED
 
             const static uint8_t SUCCESS          = 0;
             const static uint8_t INTERNAL_ERROR   = 1;
@@ -30,7 +32,7 @@ namespace WiC64 {
 
             static Command* create(Request* request);
             static void execute(Command* command);
-            static void commandTask(void* command);
+            static void commandJob(void* command);
             static const char* statusMessage(void) { return m_status_message; }
 
             Command(Request* request);
@@ -60,8 +62,10 @@ namespace WiC64 {
             virtual bool supportsProtocol();
             virtual bool supportsQueuedRequest();
             virtual bool supportsQueuedResponse();
+            bool canStreamResponse(uint32_t size);
 
             virtual const char* describe();
+            virtual void prepare(void);
             virtual void execute(void);
             virtual void responseReady();
     };
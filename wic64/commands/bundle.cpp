@@ -0,0 +1,424 @@
+#include <cstring>
+#include <cstdlib>
+
+#include "bundle.h"
+#include "wic64.h"
+#include "protocol.h"
+#include "connection.h"
+#include "resolver.h"
+#include "cache.h"
+#include "worker.h"
+#include "ring.h"
+#include "url.h"
+#include "utilities.h"
+
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+
+namespace WiC64 {
+    const char* Bundle::TAG = "BUNDLE";
+
+    extern Connection *connection;
+    extern Resolver *resolver;
+    extern ResponseCache *responseCache;
+
+    bool Bundle::supportsProtocol(void) {
+        return request()->protocol()->id() != Protocol::LEGACY;
+    }
+
+    const char* Bundle::describe() {
+        return "Bundle (fetch several URLs concurrently)";
+    }
+
+    void Bundle::execute(void) {
+        Data *payload = request()->payload();
+        char *url = payload->c_str() + 1;
+        char *end = (char*) payload->data() + payload->size();
+        ResponseCache::entry_t *cached;
+        state_t *state;
+        entry_t *entry;
+        Url expanded;
+        uint8_t jobs;
+
+        if (!connection->ready()) {
+            error(CONNECTION_ERROR, "WiFi not connected", "!0");
+            responseReady();
+            return;
+        }
+
+        if (payload->size() < 2) {
+            error(CLIENT_ERROR, "No URLs specified");
+            responseReady();
+            return;
+        }
+
+        if ((payload->data()[0] & STREAM) && request()->protocol()->id() != Protocol::EXTENDED) {
+            error(CLIENT_ERROR, "Streaming requires the extended protocol");
+            responseReady();
+            return;
+        }
+
+        state = new state_t();
+        state->command = this;
+        state->stream = payload->data()[0] & STREAM;
+        state->mutex = xSemaphoreCreateMutex();
+
+        // URLs are separated by zero bytes, the payload itself is zero terminated
+        for (; url < end; url += strlen(url) + 1) {
+            if (*url == '\0') {
+                continue;
+            }
+
+            if (state->count == WIC64_BUNDLE_MAX_URLS) {
+                state->command = NULL;
+                finish(state);
+                error(CLIENT_ERROR, "Too many URLs (max 16)");
+                responseReady();
+                return;
+            }
+            // Expanded just like Http::get() does, so that cache keys match
+            expanded = String(url);
+            expanded.sanitize();
+            expanded.expand();
+
+            state->entries[state->count++].url = strdup(expanded.c_str());
+        }
+
+        if (state->count == 0) {
+            state->command = NULL;
+            finish(state);
+            error(CLIENT_ERROR, "No URLs specified");
+            responseReady();
+            return;
+        }
+
+        // Entries are only kept until they have been streamed, otherwise they
+        // have to fit into the response after the index, so memory for an
+        // entry is reserved before it is allocated
+        state->budget = state->stream ? UINT32_MAX : 0xffff - (1 + state->count * 6);
+
+        // Fresh responses are taken from the cache instead of being fetched
+        for (uint8_t i=0; i<state->count; i++) {
+            entry = &state->entries[i];
+
+            if ((cached = responseCache->lookup(entry->url)) != NULL &&
+                responseCache->isFresh(cached) &&
+                reserve(state, cached->size) &&
+                (entry->data = (uint8_t*) malloc(cached->size)) != NULL) {
+
+                memcpy(entry->data, cached->body, cached->size);
+                entry->size = cached->size;
+                entry->status = 200;
+            }
+        }
+
+        if (state->stream) {
+            // The jobs of an aborted bundle may still be attached
+            if (!transferQueue->claim(transferTimeout)) {
+                state->command = NULL;
+                finish(state);
+                error(INTERNAL_ERROR, "Transfer queue still in use");
+                responseReady();
+                return;
+            }
+
+            // The queue stays attached until the last job has finished,
+            // even if the request is finalized before
+            state->generation = transferQueue->attach();
+
+            response()->queue(transferQueue, WIC64_FRAMED_RESPONSE_SIZE);
+            responseReady();
+        }
+
+        // Each job takes the next URL until none are left, the
+        // last job to finish completes the response
+        jobs = MIN(state->count, WIC64_WORKERS);
+        state->running = jobs + 1;
+
+        ESP_LOGI(TAG, "Fetching %d URLs over up to %d connections", state->count, jobs);
+
+        for (uint8_t i=0; i<jobs; i++) {
+            if (!workers->submit("BUNDLE", fetchJob, state)) {
+                release(state);
+            }
+        }
+
+        // Also completes the response if no job could be submitted
+        release(state);
+    }
+
+    void Bundle::fetchJob(void *state_ptr) {
+        state_t *state = (state_t*) state_ptr;
+        entry_t *entry;
+        uint8_t index;
+
+        while (true) {
+            xSemaphoreTake(state->mutex, portMAX_DELAY);
+            index = state->next < state->count ? state->next++ : WIC64_BUNDLE_MAX_URLS;
+            xSemaphoreGive(state->mutex);
+
+            if (index == WIC64_BUNDLE_MAX_URLS) {
+                break;
+            }
+            entry = &state->entries[index];
+
+            // Nobody is waiting for the remaining entries of an aborted stream
+            if (state->stream && transferQueue->aborted(state->generation)) {
+                continue;
+            }
+
+            if (entry->data == NULL) {
+                fetch(state, entry);
+            }
+
+            if (state->stream) {
+                stream(state, entry, index);
+            }
+        }
+        release(state);
+    }
+
+    bool Bundle::reserve(state_t *state, uint32_t size) {
+        bool reserved;
+
+        xSemaphoreTake(state->mutex, portMAX_DELAY);
+        if ((reserved = size <= state->budget)) {
+            state->budget -= size;
+        }
+        xSemaphoreGive(state->mutex);
+
+        return reserved;
+    }
+
+    void Bundle::unreserve(state_t *state, uint32_t size) {
+        xSemaphoreTake(state->mutex, portMAX_DELAY);
+        state->budget += size;
+        xSemaphoreGive(state->mutex);
+    }
+
+    void Bundle::fetch(state_t *state, entry_t *entry) {
+        esp_http_client_handle_t client;
+        char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+        IPAddress address;
+        int32_t content_length;
+        int32_t status;
+        uint32_t capacity = 0;
+        uint32_t size = 0;
+        int32_t bytes_read = 0;
+        uint8_t *data = NULL;
+
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+        esp_http_client_config_t config = {
+            .url = entry->url,
+            .method = HTTP_METHOD_GET,
+            .timeout_ms = (int) remoteTimeout,
+            .disable_auto_redirect = false,
+            .max_redirection_count = 10,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+        };
+
+        #pragma GCC diagnostic pop
+
+        ESP_LOGD(TAG, "Fetching URL [%s]", entry->url);
+
+        if (Resolver::host(entry->url, host, sizeof(host))) {
+            resolver->resolve(host, address);
+        }
+
+        if ((client = esp_http_client_init(&config)) == NULL) {
+            ESP_LOGE(TAG, "Failed to create esp_http_client");
+            return;
+        }
+        esp_http_client_set_header(client, "User-Agent", "WiC64/" WIC64_VERSION_SHORT_STRING " (ESP32)");
+
+        if (esp_http_client_open(client, 0) != ESP_OK ||
+            (content_length = esp_http_client_fetch_headers(client)) < 0) {
+            ESP_LOGW(TAG, "Failed to fetch [%s]", entry->url);
+            goto DONE;
+        }
+
+        if ((status = esp_http_client_get_status_code(client)) >= 400) {
+            ESP_LOGW(TAG, "Received HTTP status code %d for [%s]", status, entry->url);
+            entry->status = status;
+            goto DONE;
+        }
+
+        if (content_length > WIC64_BUNDLE_MAX_ENTRY_SIZE) {
+            goto TOO_LARGE;
+        }
+
+        // Responses of unknown length are read until the end or
+        // until one byte more than the maximum has been read
+        capacity = content_length > 0 ? content_length : WIC64_BUNDLE_MAX_ENTRY_SIZE;
+
+        if (!reserve(state, capacity)) {
+            ESP_LOGW(TAG, "Response from [%s] does not fit into the bundle", entry->url);
+            capacity = 0;
+            goto DONE;
+        }
+
+        if ((data = (uint8_t*) malloc(capacity + 1)) == NULL) {
+            ESP_LOGE(TAG, "Could not allocate %d bytes", capacity + 1);
+            goto DONE;
+        }
+
+        while (size <= capacity &&
+            (bytes_read = esp_http_client_read(client, (char*) data + size, capacity + 1 - size)) > 0) {
+            size += bytes_read;
+        }
+
+        if (bytes_read < 0) {
+            ESP_LOGW(TAG, "Read error for [%s]", entry->url);
+            free(data);
+            goto DONE;
+        }
+
+        if (size > capacity) {
+            free(data);
+            goto TOO_LARGE;
+        }
+
+        entry->data = data;
+        entry->size = size;
+        entry->status = status;
+
+        ESP_LOGI(TAG, "Fetched %d bytes from [%s]", size, entry->url);
+        goto DONE;
+
+    TOO_LARGE:
+        ESP_LOGW(TAG, "Response from [%s] exceeds %d bytes", entry->url, WIC64_BUNDLE_MAX_ENTRY_SIZE);
+
+    DONE:
+        // Only the bytes actually kept count towards the response
+        unreserve(state, capacity - (entry->data != NULL ? entry->size : 0));
+
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+    }
+
+    void Bundle::stream(state_t *state, entry_t *entry, uint8_t index) {
+        uint8_t header[5] = {
+            index,
+            (uint8_t) (entry->status & 0xff),
+            (uint8_t) (entry->status >> 8),
+            (uint8_t) (entry->size & 0xff),
+            (uint8_t) (entry->size >> 8),
+        };
+
+        xSemaphoreTake(state->mutex, portMAX_DELAY);
+
+        if (!state->aborted) {
+            state->aborted = !write(state, header, sizeof(header)) || !write(state, entry->data, entry->size);
+        }
+
+        xSemaphoreGive(state->mutex);
+
+        free(entry->data);
+        entry->data = NULL;
+    }
+
+    bool Bundle::write(state_t *state, const uint8_t *data, uint32_t size) {
+        uint8_t *segment;
+        uint32_t space;
+
+        while (size > 0) {
+            // The queue belongs to the next request once this one has been finalized
+            if (transferQueue->aborted(state->generation)) {
+                ESP_LOGW(TAG, "Request has been finalized, not streaming any more entries");
+                return false;
+            }
+
+            if ((space = transferQueue->reserve(&segment, MIN(size, WIC64_QUEUE_SEGMENT_SIZE), transferTimeout)) == 0) {
+                ESP_LOGW(TAG, "No space left in queue for more than %dms", transferTimeout);
+                return false;
+            }
+            memcpy(segment, data, space);
+            transferQueue->commit(space);
+
+            data += space;
+            size -= space;
+        }
+        return true;
+    }
+
+    void Bundle::release(state_t *state) {
+        bool last;
+
+        xSemaphoreTake(state->mutex, portMAX_DELAY);
+        last = --state->running == 0;
+        xSemaphoreGive(state->mutex);
+
+        if (last) {
+            finish(state);
+        }
+    }
+
+    void Bundle::finish(state_t *state) {
+        Data *response;
+        uint8_t *index;
+        uint8_t *data;
+        uint32_t offset;
+        entry_t *entry;
+
+        if (state->command == NULL) {
+            // Rejected before fetching anything
+        }
+        else if (state->stream) {
+            // Entries not taken by any job are sent as they are,
+            // with status 0 unless they were found in the cache
+            for (uint8_t i=state->next; i<state->count; i++) {
+                stream(state, &state->entries[i], i);
+            }
+
+            if (!transferQueue->aborted(state->generation)) {
+                transferQueue->close();
+            }
+            transferQueue->detach();
+        }
+        else {
+            response = state->command->response();
+            data = response->data();
+            index = data + 1;
+            offset = 1 + state->count * 6;
+
+            data[0] = state->count;
+
+            for (uint8_t i=0; i<state->count; i++, index += 6) {
+                entry = &state->entries[i];
+
+                if (entry->data != NULL && offset + entry->size > 0xffff) {
+                    ESP_LOGW(TAG, "Response from [%s] does not fit into the bundle", entry->url);
+                    entry->status = 0;
+                    entry->size = 0;
+                }
+
+                index[0] = entry->status & 0xff;
+                index[1] = entry->status >> 8;
+                index[2] = offset & 0xff;
+                index[3] = offset >> 8;
+                index[4] = entry->size & 0xff;
+                index[5] = entry->size >> 8;
+
+                if (entry->data != NULL) {
+                    memcpy(data + offset, entry->data, entry->size);
+                    offset += entry->size;
+                    free(entry->data);
+                    entry->data = NULL;
+                }
+            }
+            response->size(offset);
+            state->command->responseReady();
+        }
+
+        for (uint8_t i=0; i<state->count; i++) {
+            free(state->entries[i].url);
+            free(state->entries[i].data);
+        }
+
+        vSemaphoreDelete(state->mutex);
+        delete state;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef WIC64_BUNDLE_H
+#define WIC64_BUNDLE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "command.h"
+
+#define WIC64_BUNDLE_MAX_URLS 16
+#define WIC64_BUNDLE_MAX_ENTRY_SIZE 0x4000
+
+namespace WiC64 {
+
+    /* Fetches several URLs concurrently, each over its own connection,
+     * and sends them back in a single response.
+     *
+     * Payload: flags (1 byte), followed by the URLs, separated by zero
+     * bytes. If bit 0 of the flags is set, entries are streamed in the
+     * order they complete (extended protocol only), each preceded by
+     * its index (1 byte), HTTP status (2 bytes) and length (2 bytes).
+     * Otherwise the response starts with the number of entries (1 byte)
+     * and an index of HTTP status, offset and length (2 bytes each)
+     * per entry, followed by the data. A status of 0 means that the
+     * resource could not be fetched or does not fit into the response.
+     */
+    class Bundle : public Command {
+        public:
+            static const char* TAG;
+            static const uint8_t STREAM = 0x01;
+
+        private:
+            typedef struct {
+                char *url;
+                uint8_t *data;
+                uint32_t size;
+                uint16_t status;
+            } entry_t;
+
+            // Shared by the fetch jobs, freed by the last one to finish,
+            // since a streamed response may outlive the command
+            typedef struct {
+                Bundle *command;
+                bool stream;
+                bool aborted;
+                uint8_t count;
+                uint8_t next;
+                uint8_t running;
+                uint32_t budget; // bytes left in a response that is not streamed
+                uint32_t generation; // of the streamed transfer, see Ring::attach()
+                SemaphoreHandle_t mutex;
+                entry_t entries[WIC64_BUNDLE_MAX_URLS];
+            } state_t;
+
+            static void fetchJob(void* state);
+            static void fetch(state_t *state, entry_t *entry);
+            static bool reserve(state_t *state, uint32_t size);
+            static void unreserve(state_t *state, uint32_t size);
+            static void stream(state_t *state, entry_t *entry, uint8_t index);
+            static bool write(state_t *state, const uint8_t *data, uint32_t size);
+            static void release(state_t *state);
+            static void finish(state_t *state);
+
+        public:
+            using Command::Command;
+            bool supportsProtocol(void);
+            const char* describe(void);
+            void execute(void);
+    };
+}
+#endif // WIC64_BUNDLE_H
@@ -1,6 +1,8 @@
 #include "commands.h"
 #include "version.h"
 #include "http.h"
+#include "bundle.h"
+#include "prefetch.h"
 #include "ip.h"
 #include "server.h"
 #include "scan.h"
@@ -42,6 +44,10 @@ namespace WiC64 {
         WIC64_COMMAND(WIC64_CMD_HTTP_GET_ENCODED, Http),
         WIC64_COMMAND(WIC64_CMD_HTTP_POST_URL,    Http),
         WIC64_COMMAND(WIC64_CMD_HTTP_POST_DATA,   Http),
+        WIC64_COMMAND(WIC64_CMD_HTTP_GET_RANGE,   Http),
+        WIC64_COMMAND(WIC64_CMD_HTTP_REQUEST,     Http),
+        WIC64_COMMAND(WIC64_CMD_HTTP_BUNDLE,      Bundle),
+        WIC64_COMMAND(WIC64_CMD_HTTP_PREFETCH,    Prefetch),
 
         WIC64_COMMAND(WIC64_CMD_TCP_OPEN,       Tcp),
         WIC64_COMMAND(WIC64_CMD_TCP_AVAILABLE,  Tcp),
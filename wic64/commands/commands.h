@@ -21,6 +21,10 @@
 #define WIC64_CMD_HTTP_GET_ENCODED 0x0f
 #define WIC64_CMD_HTTP_POST_URL    0x28
 #define WIC64_CMD_HTTP_POST_DATA   0x2b
+#define WIC64_CMD_HTTP_GET_RANGE   0x33
+#define WIC64_CMD_HTTP_REQUEST     0x34
+#define WIC64_CMD_HTTP_BUNDLE      0x35
+#define WIC64_CMD_HTTP_PREFETCH    0x36
 
 #define WIC64_CMD_TCP_OPEN      0x21
 #define WIC64_CMD_TCP_AVAILABLE 0x30
@@ -14,16 +14,21 @@ namespace WiC64 {
     extern Connection *connection;
     extern Settings *settings;
 
-    void Http::execute(void) {
-        if (!connection->ready()) {
-            const char* message = !connection->connected()
-                ? "WiFi not connected "
-                : "No IP address assigned";
+    void Http::connectionError(void) {
+        const char* message = !connection->connected()
+            ? "WiFi not connected "
+            : "No IP address assigned";
 
-            ESP_LOGE(TAG, "Can't send HTTP request: %s", message);
+        ESP_LOGE(TAG, "Can't send HTTP request: %s", message);
 
-            error(CONNECTION_ERROR, message, "!0");
-            responseReady();
+        error(CONNECTION_ERROR, message, "!0");
+        responseReady();
+    }
+
+    void Http::execute(void) {
+        // GET requests may still be answered from the cache, see get()
+        if (!connection->ready() && !isGet()) {
+            connectionError();
             return;
         }
 
@@ -33,6 +38,14 @@ namespace WiC64 {
                 get();
                 break;
 
+            case WIC64_CMD_HTTP_GET_RANGE:
+                getRange();
+                break;
+
+            case WIC64_CMD_HTTP_REQUEST:
+                sendRequest();
+                break;
+
             case WIC64_CMD_HTTP_POST_URL:
                 postUrl();
                 break;
@@ -59,10 +72,103 @@ namespace WiC64 {
         m_url.sanitize();
         m_url.expand();
 
+        if (!connection->ready()) {
+            if (httpClient->getOffline(this, m_url)) {
+                responseReady();
+            } else {
+                connectionError();
+            }
+            return;
+        }
+
         ESP_LOGI(TAG, "Fetching URL [%s]", m_url.c_str());
         httpClient->get(this, m_url); // client will call responseReady()
     }
 
+    void Http::getRange(void) {
+        // Payload: offset (4 bytes), length (2 bytes), URL
+        Data* payload = request()->payload();
+        uint8_t* data = payload->data();
+        uint32_t offset;
+        uint16_t length;
+
+        if (payload->size() <= 6) {
+            error(CLIENT_ERROR, "Offset, length and URL required");
+            responseReady();
+            return;
+        }
+
+        offset = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+        length = data[4] | (data[5] << 8);
+
+        if (length == 0) {
+            error(CLIENT_ERROR, "Range length must not be zero");
+            responseReady();
+            return;
+        }
+
+        m_url = String(data + 6, payload->size() - 6);
+
+        m_url.sanitize();
+        m_url.expand();
+
+        ESP_LOGI(TAG, "Fetching %d bytes at offset %u from URL [%s]", length, offset, m_url.c_str());
+        httpClient->getRange(this, m_url, offset, length); // client will call responseReady()
+    }
+
+    void Http::sendRequest(void) {
+        // Payload: method (1 byte), URL length (2 bytes), content type
+        // length (1 byte), URL, content type, request body (remaining bytes)
+        Data* payload = request()->payload();
+        uint8_t* data = payload->data();
+        uint16_t urlLength;
+        uint8_t contentTypeLength;
+        uint32_t offset;
+        esp_http_client_method_t method;
+
+        if (payload->size() < 4) {
+            error(CLIENT_ERROR, "Method, URL and content type required");
+            responseReady();
+            return;
+        }
+
+        switch (data[0]) {
+            case METHOD_GET:    method = HTTP_METHOD_GET;    break;
+            case METHOD_POST:   method = HTTP_METHOD_POST;   break;
+            case METHOD_PUT:    method = HTTP_METHOD_PUT;    break;
+            case METHOD_PATCH:  method = HTTP_METHOD_PATCH;  break;
+            case METHOD_DELETE: method = HTTP_METHOD_DELETE; break;
+            case METHOD_HEAD:   method = HTTP_METHOD_HEAD;   break;
+
+            default:
+                error(CLIENT_ERROR, "Unknown HTTP method");
+                responseReady();
+                return;
+        }
+
+        urlLength = data[1] | (data[2] << 8);
+        contentTypeLength = data[3];
+        offset = 4 + urlLength + contentTypeLength;
+
+        if (urlLength == 0 || offset > payload->size()) {
+            error(CLIENT_ERROR, "Malformed request");
+            responseReady();
+            return;
+        }
+
+        m_url = String(data + 4, urlLength);
+        m_url.sanitize();
+        m_url.expand();
+
+        m_contentType = String(data + 4 + urlLength, contentTypeLength);
+
+        // The body is sent straight from the payload buffer
+        m_body.set(data + offset, payload->size() - offset);
+
+        ESP_LOGI(TAG, "Sending request with %d bytes of data to URL [%s]", m_body.size(), m_url.c_str());
+        httpClient->send(this, method, m_url, m_contentType.c_str(), &m_body); // client will call responseReady()
+    }
+
     void Http::postUrl() {
         Data* payload = request()->payload();
         m_url = String(payload->data(), payload->size());
@@ -85,9 +191,22 @@ namespace WiC64 {
 
     bool Http::supportsProtocol(void) {
         if (request()->protocol()->id() == Protocol::EXTENDED) return true;
+        if (id() == WIC64_CMD_HTTP_REQUEST) return false;
         return Command::supportsProtocol();
     }
 
+    Http::~Http() {
+        // A connection opened by prepare() is of no use once the request is done
+        httpClient->dropPreparedConnection();
+    }
+
+    void Http::prepare(void) {
+        // Open the connection to the preset URL while the C64 is still sending the POST data
+        if (id() == WIC64_CMD_HTTP_POST_DATA && connection->ready()) {
+            httpClient->prepare(this, request()->payload());
+        }
+    }
+
     bool Http::supportsQueuedRequest(void) {
         return id() == WIC64_CMD_HTTP_POST_DATA;
     }
@@ -101,6 +220,12 @@ namespace WiC64 {
             case WIC64_CMD_HTTP_GET_ENCODED:
                 return "HTTP GET (fetch encoded URL)";
 
+            case WIC64_CMD_HTTP_GET_RANGE:
+                return "HTTP GET range (fetch part of URL)";
+
+            case WIC64_CMD_HTTP_REQUEST:
+                return "HTTP request (method, URL, content type and body)";
+
             case WIC64_CMD_HTTP_POST_URL:
                 return "HTTP POST URL (preset URL to POST to)";
 
@@ -115,6 +240,10 @@ namespace WiC64 {
         return id() == WIC64_CMD_HTTP_GET_ENCODED;
     }
 
+    bool Http::isGet(void) {
+        return id() == WIC64_CMD_HTTP_GET || id() == WIC64_CMD_HTTP_GET_ENCODED;
+    }
+
     void Http::lieAboutResponseSizeForProgramFile(void) {
         // For legacy requests only: If a cbm "program file" is requested, lie
         // about the size of the response data by subtracting 2. This has been
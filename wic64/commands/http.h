@@ -10,17 +10,37 @@ namespace WiC64 {
         public: static const char* TAG;
         private:
             Url m_url;
+            String m_contentType;
+            Data m_body;
+
+            // Method codes used by WIC64_CMD_HTTP_REQUEST
+            enum method_t {
+                METHOD_GET,
+                METHOD_POST,
+                METHOD_PUT,
+                METHOD_PATCH,
+                METHOD_DELETE,
+                METHOD_HEAD,
+            };
+
+            void connectionError(void);
 
         public:
             using Command::Command;
+            ~Http();
+
             bool supportsProtocol();
             bool supportsQueuedRequest();
+            void prepare(void);
             const char* describe(void);
 
             bool isEncoded(void);
+            bool isGet(void);
 
             void execute(void);
             void get(void);
+            void getRange(void);
+            void sendRequest(void);
             void postUrl(void);
             void postData(void);
 
@@ -0,0 +1,51 @@
+#include <cstring>
+
+#include "prefetch.h"
+#include "prefetcher.h"
+#include "protocol.h"
+#include "url.h"
+
+namespace WiC64 {
+    const char* Prefetch::TAG = "PREFETCH";
+
+    extern Prefetcher *prefetcher;
+
+    bool Prefetch::supportsProtocol(void) {
+        return request()->protocol()->id() != Protocol::LEGACY;
+    }
+
+    const char* Prefetch::describe() {
+        return "Prefetch (fetch URLs in the background)";
+    }
+
+    void Prefetch::execute(void) {
+        // Payload: URLs separated by zero bytes
+        Data *payload = request()->payload();
+        char *url = payload->c_str();
+        char *end = url + payload->size();
+        uint8_t queued = 0;
+        Url expanded;
+
+        for (; url < end; url += strlen(url) + 1) {
+            if (*url == '\0') {
+                continue;
+            }
+
+            // Expanded the same way as by Http::get(), so that
+            // the URL of the later GET request matches
+            expanded = String(url);
+            expanded.sanitize();
+            expanded.expand();
+
+            if (prefetcher->queue(expanded.c_str())) {
+                queued++;
+            }
+        }
+
+        ESP_LOGI(TAG, "Queued %d URLs for prefetching", queued);
+
+        // Respond with the number of URLs queued, without waiting for them
+        response()->appendByte(queued);
+        responseReady();
+    }
+}
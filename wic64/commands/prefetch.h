@@ -0,0 +1,17 @@
+#ifndef WIC64_PREFETCH_H
+#define WIC64_PREFETCH_H
+
+#include "command.h"
+
+namespace WiC64 {
+    class Prefetch : public Command {
+        public:
+            static const char* TAG;
+
+            using Command::Command;
+            bool supportsProtocol(void);
+            const char* describe(void);
+            void execute(void);
+    };
+}
+#endif // WIC64_PREFETCH_H
@@ -3,12 +3,15 @@
 
 #include "connection.h"
 #include "display.h"
+#include "settings.h"
+#include "resolver.h"
 
 namespace WiC64 {
     const char* Connection::TAG = "CONNECTION";
 
     extern Connection *connection;
     extern Display *display;
+    extern Settings *settings;
 
     Connection::Connection() {
         WiFi.setHostname(("wic64-" + WiFi.macAddress()).c_str());
@@ -64,6 +67,15 @@ namespace WiC64 {
         ESP_LOGI(TAG, "GATE: %s", WiFi.gatewayIP().toString().c_str());
         ESP_LOGI(TAG, "DNS1: %s", WiFi.dnsIP().toString().c_str());
         display->ip(connection->ipAddress());
+
+        // Addresses resolved on a previous network may no longer be valid,
+        // but the configured server will most likely be requested next
+        char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+        resolver->flush();
+
+        if (Resolver::host(settings->server().c_str(), host, sizeof(host))) {
+            resolver->prefetch(host);
+        }
     }
 
     void Connection::connect() {
@@ -2,10 +2,12 @@
 #include <cstring>
 
 #include "data.h"
+#include "buffer.h"
 
 namespace WiC64 {
+    extern BufferPool *bufferPool;
+
     Data::Data() {
-        m_data = transferBuffer;
     }
 
     Data::Data(uint8_t *data, uint32_t size) {
@@ -13,8 +15,30 @@ namespace WiC64 {
     }
 
     char* Data::c_str() {
-        m_data[m_size] = '\0';
-        return (char*) m_data;
+        data()[m_size] = '\0';
+        return (char*) data();
+    }
+
+    Data::~Data() {
+        if (m_buffer != NULL) {
+            m_buffer->release();
+        }
+    }
+
+    // returns the transfer buffer held by this instance,
+    // acquiring one from the pool on first use
+    uint8_t* Data::buffer() {
+        if (m_buffer == NULL) {
+            m_buffer = bufferPool->acquire();
+        }
+        return (m_buffer != NULL) ? m_buffer->data() : NULL;
+    }
+
+    uint8_t* Data::data() {
+        if (m_data == NULL) {
+            m_data = buffer();
+        }
+        return m_data;
     }
 
     void Data::set(uint8_t *data, uint32_t size) {
@@ -29,28 +53,37 @@ namespace WiC64 {
         m_data[m_size] = '\0';
     }
 
+    // shares the data and the buffer holding it without copying
     void Data::set(Data *data) {
+        if (data->m_buffer != NULL && data->m_buffer != m_buffer) {
+            data->m_buffer->retain();
+
+            if (m_buffer != NULL) {
+                m_buffer->release();
+            }
+            m_buffer = data->m_buffer;
+        }
         set(data->data(), data->size());
     }
 
     // copies string content and adds a terminating nullbyte
     void Data::copyString(const char *c_str) {
-        m_data = transferBuffer;
+        m_data = buffer();
         m_size = strlen(c_str)+1;
-        strncpy((char*) transferBuffer, c_str, m_size+1);
+        strncpy((char*) m_data, c_str, m_size+1);
     }
 
     // copies string content without adding terminating nullbyte
     void Data::copyData(const char *c_str) {
-        m_data = transferBuffer;
+        m_data = buffer();
         m_size = strlen(c_str);
-        strncpy((char*) transferBuffer, c_str, m_size+1);
+        strncpy((char*) m_data, c_str, m_size+1);
     }
 
     void Data::appendByte(const uint8_t byte) {
-        m_data[m_size] = byte;
+        data()[m_size] = byte;
         m_size++;
-        m_data[m_size] = '\0';
+        data()[m_size] = '\0';
     }
 
     void Data::appendField(const String &string) {
@@ -59,10 +92,10 @@ namespace WiC64 {
 
     void Data::appendField(const String &string, const char separator) {
         size_t len = string.length();
-        memcpy(m_data + m_index, string.c_str(), len);
+        memcpy(data() + m_index, string.c_str(), len);
 
         m_index += len;
-        m_data[m_index] = separator;
+        data()[m_index] = separator;
         m_index++;
         m_size += len + 1;
     }
@@ -74,7 +107,7 @@ namespace WiC64 {
     const char* Data::field(uint8_t index, char separator, char* dst) {
         dst[0] = '\0';
 
-        char* begin = (char*) m_data;
+        char* begin = (char*) data();
         char* end = begin;
         char* previous_end = end;
         uint8_t size;
@@ -87,8 +120,8 @@ namespace WiC64 {
                     begin = previous_end;
 
                     size =
-                        (end - (char*) m_data) -
-                        (begin - (char*) m_data);
+                        (end - (char*) data()) -
+                        (begin - (char*) data());
 
                     memcpy(dst, begin, size);
                     dst[size] = '\0';
@@ -112,10 +145,15 @@ namespace WiC64 {
 
     void Data::size(uint32_t size) {
         m_size = size;
-        m_data[size] = '\0';
+
+        // Queued data is not backed by a buffer, and there's
+        // no need to acquire one just to terminate empty data
+        if (size < WIC64_BUFFER_SIZE && (m_data != NULL || size > 0)) {
+            data()[size] = '\0';
+        }
     }
 
-    void Data::queue(QueueHandle_t queue, uint32_t size) {
+    void Data::queue(Ring* queue, uint32_t size) {
         m_queue = queue;
         m_size = size;
     }
@@ -132,14 +170,18 @@ namespace WiC64 {
         return m_queue != NULL;
     }
 
+    bool Data::isFramed(void) {
+        return isQueued() && m_size == WIC64_FRAMED_RESPONSE_SIZE;
+    }
+
     int64_t Data::sizeToReport() {
         return (m_sizeToReport > -1) ? m_sizeToReport : m_size;
     }
 
     Data* Data::zeroTerminated() {
-        if (m_data[m_size-1] != 0) {
+        if (data()[m_size-1] != 0) {
             m_size++;
-            m_data[m_size] = '\0';
+            data()[m_size] = '\0';
         }
         return this;
     }
@@ -3,25 +3,35 @@
 
 #include <cstdint>
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 
 #include "wic64.h"
+#include "ring.h"
+#include "buffer.h"
+#include "arena.h"
 
 namespace WiC64 {
     class Data {
+        public:
+            WIC64_ARENA_ALLOCATED
+
         private:
+            Buffer *m_buffer = NULL;
             uint8_t *m_data = NULL;
             uint32_t m_index = 0;
 
             uint32_t m_size = 0;
             int64_t m_sizeToReport = -1;
 
-            QueueHandle_t m_queue = NULL;
+            Ring *m_queue = NULL;
+
+            uint8_t* buffer();
+
         public:
             Data();
             Data(uint8_t* data, uint32_t size);
+            ~Data();
 
-            uint8_t* data() { return m_data; }
+            uint8_t* data();
             char* c_str();
 
             void set(Data* data);
@@ -44,12 +54,13 @@ namespace WiC64 {
 
             Data* zeroTerminated();
 
-            QueueHandle_t queue() { return m_queue; }
-            void queue(QueueHandle_t queue, uint32_t size);
+            Ring* queue() { return m_queue; }
+            void queue(Ring* queue, uint32_t size);
 
             bool isPresent(void);
             bool isEmpty(void);
             bool isQueued(void);
+            bool isFramed(void);
     };
 }
 #endif // WIC64_DATA_H
\ No newline at end of file
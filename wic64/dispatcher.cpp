@@ -0,0 +1,110 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "dispatcher.h"
+
+namespace WiC64 {
+    const char* Dispatcher::TAG = "DISPATCHER";
+
+    Dispatcher::Dispatcher(const char* name, UBaseType_t priority, uint32_t stackSize, BaseType_t core) {
+        m_name = name;
+
+        xTaskCreatePinnedToCore(task, name, stackSize, this, priority, &m_task, core);
+
+        if (m_task == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create %s dispatcher task", name);
+        }
+    }
+
+    void Dispatcher::on(uint8_t event, handler_t handler) {
+        if (event >= MAX_EVENTS) {
+            ESP_LOGE(TAG, "Can't register handler for %s event %d", m_name, event);
+            return;
+        }
+        m_handlers[event] = handler;
+    }
+
+    bool IRAM_ATTR Dispatcher::post(uint8_t event) {
+        uint32_t head;
+
+        portENTER_CRITICAL_SAFE(&m_lock);
+        head = m_head;
+
+        if (head - m_tail >= RING_SIZE) {
+            m_dropped++;
+            portEXIT_CRITICAL_SAFE(&m_lock);
+            return false;
+        }
+
+        m_events[head % RING_SIZE] = event;
+        m_timestamps[head % RING_SIZE] = esp_timer_get_time();
+
+        // make sure the consumer sees the event before the new head
+        __sync_synchronize();
+        m_head = head + 1;
+        m_posted++;
+        portEXIT_CRITICAL_SAFE(&m_lock);
+
+        if (xPortInIsrContext()) {
+            BaseType_t task_woken = pdFALSE;
+            vTaskNotifyGiveFromISR(m_task, &task_woken);
+
+            if (task_woken) {
+                portYIELD_FROM_ISR();
+            }
+        } else {
+            xTaskNotifyGive(m_task);
+        }
+        return true;
+    }
+
+    void Dispatcher::task(void* dispatcher) {
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            ((Dispatcher*) dispatcher)->dispatch();
+        }
+    }
+
+    void Dispatcher::dispatch(void) {
+        uint32_t tail;
+        uint8_t event;
+        uint32_t latency;
+
+        // Drain the ring, several events may have been
+        // posted before this task was scheduled
+        while ((tail = m_tail) != m_head) {
+            event = m_events[tail % RING_SIZE];
+            latency = esp_timer_get_time() - m_timestamps[tail % RING_SIZE];
+
+            __sync_synchronize();
+            m_tail = tail + 1;
+
+            m_dispatched++;
+            m_totalLatency += latency;
+            if (latency > m_maxLatency) m_maxLatency = latency;
+
+            ESP_LOGV(TAG, "Dispatching %s event %d after %dus", m_name, event, latency);
+
+            if (event < MAX_EVENTS && m_handlers[event] != NULL) {
+                m_handlers[event]();
+            } else {
+                ESP_LOGW(TAG, "No handler registered for %s event %d", m_name, event);
+            }
+        }
+    }
+
+    String Dispatcher::statistics(void) {
+        char statistics[160];
+
+        snprintf(statistics, sizeof(statistics),
+            "%s: %d events posted, %d dispatched, %d dropped, latency avg %lldus, max %dus",
+            m_name,
+            m_posted,
+            m_dispatched,
+            m_dropped,
+            m_dispatched ? m_totalLatency / m_dispatched : 0,
+            m_maxLatency);
+
+        return String(statistics);
+    }
+}
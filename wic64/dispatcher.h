@@ -0,0 +1,63 @@
+#ifndef WIC64_DISPATCHER_H
+#define WIC64_DISPATCHER_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "WString.h"
+
+namespace WiC64 {
+
+    /* Lightweight replacement for an esp_event loop: a dedicated task
+     * that is woken by a direct task notification and calls the handler
+     * registered for each event code taken from a lock-free ring.
+     *
+     * Events may be posted from several tasks and from ISRs at the same
+     * time, e.g. by the handshake ISR and Userport::refillStream(), so
+     * producers serialize on a spinlock for the few instructions needed
+     * to claim a slot. The dispatcher task is the only consumer.
+     */
+    class Dispatcher {
+        public:
+            static const char* TAG;
+            typedef void (*handler_t)(void);
+
+            static const uint8_t MAX_EVENTS = 8;
+
+        private:
+            static const uint8_t RING_SIZE = 16; // power of two
+
+            const char* m_name;
+            TaskHandle_t m_task = NULL;
+            handler_t m_handlers[MAX_EVENTS] = { NULL };
+
+            volatile uint8_t m_events[RING_SIZE];
+            volatile int64_t m_timestamps[RING_SIZE];
+            volatile uint32_t m_head = 0; // written by producers holding m_lock
+            volatile uint32_t m_tail = 0; // written by the consumer only
+            portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+            volatile uint32_t m_posted = 0;
+            volatile uint32_t m_dropped = 0;
+            uint32_t m_dispatched = 0;
+            int64_t m_totalLatency = 0;
+            uint32_t m_maxLatency = 0;
+
+            static void task(void* dispatcher);
+            void dispatch(void);
+
+        public:
+            Dispatcher(const char* name, UBaseType_t priority, uint32_t stackSize, BaseType_t core);
+
+            void on(uint8_t event, handler_t handler);
+            bool IRAM_ATTR post(uint8_t event);
+
+            // True if called from one of this dispatcher's handlers
+            bool isCurrentTask(void) { return xTaskGetCurrentTaskHandle() == m_task; }
+
+            String statistics(void);
+    };
+}
+
+#endif // WIC64_DISPATCHER_H
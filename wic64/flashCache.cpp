@@ -0,0 +1,428 @@
+#include <cstring>
+#include <cstdlib>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp32-hal.h"
+#include "SPIFFS.h"
+
+#include "flashCache.h"
+#include "worker.h"
+
+namespace WiC64 {
+    const char* FlashCache::TAG = "FLASHCACHE";
+
+    FlashCache::FlashCache() {
+        m_lock = xSemaphoreCreateMutex();
+
+        for (uint8_t i=0; i<WIC64_FLASH_CACHE_ENTRIES; i++) {
+            m_records[i].hash = 0;
+            m_records[i].size = 0;
+        }
+
+        // Formats the partition on first use, which takes a few seconds
+        if (!SPIFFS.begin(true, WIC64_FLASH_CACHE_PATH, 2, WIC64_FLASH_CACHE_PARTITION)) {
+            ESP_LOGW(TAG, "Partition \"%s\" not available, flash cache disabled",
+                WIC64_FLASH_CACHE_PARTITION);
+            return;
+        }
+        m_mounted = true;
+        load();
+
+        ESP_LOGI(TAG, "Flash cache initialized, %d of %d bytes used",
+            SPIFFS.usedBytes(), SPIFFS.totalBytes());
+    }
+
+    uint32_t FlashCache::hash(const char* url) {
+        // FNV-1a, 0 marks unused records
+        uint32_t hash = 2166136261u;
+
+        while (*url != '\0') {
+            hash = (hash ^ (uint8_t) *url++) * 16777619u;
+        }
+        return hash ? hash : 1;
+    }
+
+    void FlashCache::path(uint32_t hash, char *path) {
+        sprintf(path, "/%08x", hash);
+    }
+
+    void FlashCache::load(void) {
+        File root = SPIFFS.open("/");
+        File file;
+        file_header_t header;
+        record_t *record;
+        char buffer[256];
+        String path;
+
+        while ((file = root.openNextFile())) {
+            path = file.path();
+
+            if ((record = freeRecord()) == NULL ||
+                file.read((uint8_t*) &header, sizeof(header)) != sizeof(header) ||
+                header.magic != MAGIC ||
+                header.urlLength >= sizeof(buffer)) {
+
+                ESP_LOGW(TAG, "Removing %s", path.c_str());
+                file.close();
+                SPIFFS.remove(path);
+                continue;
+            }
+
+            file.read((uint8_t*) buffer, header.urlLength);
+            buffer[header.urlLength] = '\0';
+            record->url = buffer;
+
+            file.read((uint8_t*) buffer, header.etagLength);
+            buffer[header.etagLength] = '\0';
+            record->etag = buffer;
+
+            file.read((uint8_t*) buffer, header.lastModifiedLength);
+            buffer[header.lastModifiedLength] = '\0';
+            record->lastModified = buffer;
+
+            record->hash = hash(record->url.c_str());
+            record->size = header.size;
+            record->timeStored = header.timeStored;
+            record->maxAge = header.maxAge;
+
+            // Older responses are evicted first
+            record->timeUsed = 0;
+
+            ESP_LOGD(TAG, "Found %d bytes for %s", record->size, record->url.c_str());
+            file.close();
+        }
+    }
+
+    FlashCache::record_t* FlashCache::freeRecord(void) {
+        for (uint8_t i=0; i<WIC64_FLASH_CACHE_ENTRIES; i++) {
+            if (m_records[i].hash == 0) {
+                return &m_records[i];
+            }
+        }
+        return NULL;
+    }
+
+    FlashCache::record_t* FlashCache::leastRecentlyUsed(void) {
+        record_t *record = NULL;
+
+        for (uint8_t i=0; i<WIC64_FLASH_CACHE_ENTRIES; i++) {
+            if (m_records[i].hash != 0 && (record == NULL ||
+                m_records[i].timeUsed < record->timeUsed ||
+                (m_records[i].timeUsed == record->timeUsed && m_records[i].timeStored < record->timeStored))) {
+                record = &m_records[i];
+            }
+        }
+        return record;
+    }
+
+    void FlashCache::remove(record_t *record) {
+        char name[10];
+
+        path(record->hash, name);
+        SPIFFS.remove(name);
+
+        record->hash = 0;
+        record->size = 0;
+        record->url = "";
+        record->etag = "";
+        record->lastModified = "";
+    }
+
+    FlashCache::record_t* FlashCache::lookup(const char* url) {
+        uint32_t h;
+
+        if (!m_mounted) {
+            return NULL;
+        }
+        h = hash(url);
+
+        for (uint8_t i=0; i<WIC64_FLASH_CACHE_ENTRIES; i++) {
+            if (m_records[i].hash == h && m_records[i].url == url) {
+                return &m_records[i];
+            }
+        }
+        return NULL;
+    }
+
+    void FlashCache::lock(void) {
+        xSemaphoreTake(m_lock, portMAX_DELAY);
+    }
+
+    void FlashCache::unlock(void) {
+        xSemaphoreGive(m_lock);
+    }
+
+    bool FlashCache::isFresh(record_t *record) {
+        time_t now = time(NULL);
+
+        // Without a valid time from NTP, freshness can't be determined
+        if (now < 1600000000 || record->maxAge < 0) {
+            return false;
+        }
+        return (uint32_t) now - record->timeStored < (uint32_t) record->maxAge / 1000;
+    }
+
+    bool FlashCache::read(record_t *record, Data *response, bool offline) {
+        char name[10];
+        File file;
+        file_header_t header;
+        uint32_t offset;
+
+        path(record->hash, name);
+
+        if (!(file = SPIFFS.open(name, FILE_READ)) ||
+            file.read((uint8_t*) &header, sizeof(header)) != sizeof(header)) {
+            ESP_LOGE(TAG, "Could not read %s", name);
+            remove(record);
+            return false;
+        }
+
+        offset = sizeof(header) + header.urlLength + header.etagLength + header.lastModifiedLength;
+
+        if (!file.seek(offset) || file.read(response->data(), header.size) != header.size) {
+            ESP_LOGE(TAG, "Could not read %d bytes from %s", header.size, name);
+            file.close();
+            remove(record);
+            return false;
+        }
+        file.close();
+
+        response->size(header.size);
+        record->timeUsed = millis();
+
+        m_hits++;
+        if (offline) m_offlineHits++;
+        m_bytesRead += header.size;
+
+        ESP_LOGI(TAG, "Serving %d bytes from flash%s", header.size, offline ? " (offline)" : "");
+        return true;
+    }
+
+    bool FlashCache::seenBefore(uint32_t hash) {
+        for (uint8_t i=0; i<SEEN_SIZE; i++) {
+            if (m_seen[i] == hash) {
+                return true;
+            }
+        }
+        m_seen[m_seenIndex] = hash;
+        m_seenIndex = (m_seenIndex + 1) % SEEN_SIZE;
+        return false;
+    }
+
+    // Returns true if a response to this URL should be stored, which
+    // is the case once it has been requested at least twice
+    bool FlashCache::wants(const char* url) {
+        bool seen;
+
+        if (!m_mounted) {
+            return false;
+        }
+
+        lock();
+        seen = seenBefore(hash(url));
+        unlock();
+
+        return seen;
+    }
+
+    bool FlashCache::withinWriteBudget(uint32_t size) {
+        if (millis() - m_hourStarted > 3600000) {
+            m_hourStarted = millis();
+            m_bytesWrittenThisHour = 0;
+        }
+        return m_bytesWrittenThisHour + size <= WIC64_FLASH_CACHE_WRITE_BUDGET;
+    }
+
+    void FlashCache::store(const char* url, const uint8_t *body, uint32_t size,
+        const char* etag, const char* lastModified, int32_t maxAge) {
+
+        uint32_t h = hash(url);
+        uint32_t required, limit;
+        record_t *record;
+        file_header_t header;
+        char name[10];
+        File file;
+        int64_t start;
+        bool success;
+
+        if (!m_mounted || size == 0) {
+            return;
+        }
+
+        // Don't write the same response again
+        if ((record = lookup(url)) != NULL && record->size == size &&
+            ((etag[0] != '\0' && record->etag == etag) ||
+             (lastModified[0] != '\0' && record->lastModified == lastModified))) {
+            record->timeUsed = millis();
+            return;
+        }
+
+        header.magic = MAGIC;
+        header.size = size;
+        header.timeStored = time(NULL);
+        header.maxAge = maxAge;
+        header.urlLength = strlen(url);
+        header.etagLength = strlen(etag);
+        header.lastModifiedLength = strlen(lastModified);
+
+        required = sizeof(header) + header.urlLength + header.etagLength + header.lastModifiedLength + header.size;
+
+        // Leave a quarter of the partition free, SPIFFS needs the
+        // headroom for garbage collection and wear leveling
+        limit = SPIFFS.totalBytes() / 4 * 3;
+
+        if (header.urlLength > 255 || required > limit / 2) {
+            return;
+        }
+
+        if (!withinWriteBudget(required)) {
+            ESP_LOGW(TAG, "Write budget of %d bytes per hour exceeded", WIC64_FLASH_CACHE_WRITE_BUDGET);
+            m_skippedWrites++;
+            return;
+        }
+
+        if (record != NULL) {
+            remove(record);
+        }
+
+        while ((record = freeRecord()) == NULL || SPIFFS.usedBytes() + required > limit) {
+            if ((record = leastRecentlyUsed()) == NULL) {
+                return;
+            }
+            ESP_LOGD(TAG, "Evicting %s", record->url.c_str());
+            remove(record);
+            m_evictions++;
+        }
+
+        path(h, name);
+        start = esp_timer_get_time();
+
+        success = (file = SPIFFS.open(name, FILE_WRITE)) &&
+            file.write((uint8_t*) &header, sizeof(header)) == sizeof(header) &&
+            file.write((uint8_t*) url, header.urlLength) == header.urlLength &&
+            file.write((uint8_t*) etag, header.etagLength) == header.etagLength &&
+            file.write((uint8_t*) lastModified, header.lastModifiedLength) == header.lastModifiedLength &&
+            file.write(body, header.size) == header.size;
+
+        if (file) file.close();
+
+        m_writeTime += esp_timer_get_time() - start;
+        m_bytesWritten += required;
+        m_bytesWrittenThisHour += required;
+
+        if (!success) {
+            ESP_LOGE(TAG, "Could not write %s", name);
+            SPIFFS.remove(name);
+            return;
+        }
+
+        record->hash = h;
+        record->url = url;
+        record->etag = etag;
+        record->lastModified = lastModified;
+        record->size = header.size;
+        record->timeStored = header.timeStored;
+        record->maxAge = maxAge;
+        record->timeUsed = millis();
+
+        m_writes++;
+        ESP_LOGD(TAG, "Stored %d bytes for %s in %lldms",
+            header.size, url, (esp_timer_get_time() - start) / 1000);
+    }
+
+    // Keeps a copy of the response until it has been sent to the C64, so
+    // that the SPIFFS write does not delay the response, see startDeferredStore()
+    void FlashCache::deferStore(const char* url, Data *response,
+        const char* etag, const char* lastModified, int32_t maxAge) {
+
+        uint8_t *body;
+        store_job_t *job;
+
+        if (!m_mounted || response->size() == 0) {
+            return;
+        }
+
+        // The write runs while the next request is already being handled,
+        // so it must not hold on to a transfer buffer from the pool
+        if ((body = (uint8_t*) malloc(response->size())) == NULL) {
+            ESP_LOGW(TAG, "Not enough memory to copy response of %d bytes, not storing it",
+                response->size());
+            m_skippedWrites++;
+            return;
+        }
+        memcpy(body, response->data(), response->size());
+
+        job = new store_job_t();
+        job->url = url;
+        job->etag = etag;
+        job->lastModified = lastModified;
+        job->maxAge = maxAge;
+        job->body = body;
+        job->size = response->size();
+
+        // Only the response to the current request is pending
+        startDeferredStore(false);
+        m_deferred = job;
+    }
+
+    void FlashCache::startDeferredStore(bool responseSent) {
+        store_job_t *job = m_deferred;
+
+        if (job == NULL) {
+            return;
+        }
+        m_deferred = NULL;
+
+        if (responseSent && workers->submit("FLASH", storeJob, job)) {
+            return;
+        }
+
+        free(job->body);
+        delete job;
+    }
+
+    void FlashCache::storeJob(void *job_ptr) {
+        store_job_t *job = (store_job_t*) job_ptr;
+
+        flashCache->lock();
+        flashCache->store(job->url.c_str(), job->body, job->size,
+            job->etag.c_str(), job->lastModified.c_str(), job->maxAge);
+        flashCache->unlock();
+
+        free(job->body);
+        delete job;
+    }
+
+    String FlashCache::statistics(void) {
+        char statistics[320];
+        uint8_t records = 0;
+
+        if (!m_mounted) {
+            return "Flash cache: partition \"" WIC64_FLASH_CACHE_PARTITION "\" not available";
+        }
+
+        for (uint8_t i=0; i<WIC64_FLASH_CACHE_ENTRIES; i++) {
+            if (m_records[i].hash != 0) records++;
+        }
+
+        snprintf(statistics, sizeof(statistics),
+            "Flash cache: %d responses, %d of %d bytes used, %d hits (%d offline), %llu bytes read\n"
+            "Flash writes: %d responses, %d skipped, %d evicted, %llu bytes written at %lldkb/s, "
+            "%d%% of the hourly budget used, partition written %.2f times",
+            records,
+            SPIFFS.usedBytes(),
+            SPIFFS.totalBytes(),
+            m_hits,
+            m_offlineHits,
+            m_bytesRead,
+            m_writes,
+            m_skippedWrites,
+            m_evictions,
+            m_bytesWritten,
+            m_writeTime ? (int64_t) (m_bytesWritten * 1000000 / m_writeTime / 1024) : 0,
+            m_bytesWrittenThisHour * 100 / WIC64_FLASH_CACHE_WRITE_BUDGET,
+            (double) m_bytesWritten / SPIFFS.totalBytes());
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef WIC64_FLASH_CACHE_H
+#define WIC64_FLASH_CACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "WString.h"
+
+#include "data.h"
+
+#define WIC64_FLASH_CACHE_PARTITION "cache"
+#define WIC64_FLASH_CACHE_PATH "/cache"
+#define WIC64_FLASH_CACHE_ENTRIES 32
+
+// At most this many bytes are written to flash per hour,
+// further responses are not stored until the next hour
+#define WIC64_FLASH_CACHE_WRITE_BUDGET (512 * 1024)
+
+namespace WiC64 {
+
+    /* Content cache on the SPIFFS partition "cache", so that responses
+     * to HTTP GET requests survive a reboot and can still be served
+     * while WiFi is down.
+     *
+     * To save flash writes, a response is only written once its URL
+     * has been requested at least twice since boot, an unchanged
+     * response (same ETag or Last-Modified) is never written again,
+     * and revalidating a response does not update it in flash. An
+     * index of all stored responses is kept in RAM, the least
+     * recently used response is removed first to make room.
+     *
+     * Responses are written by a worker once they have been sent to
+     * the C64, see deferStore(). Callers have to lock() the cache while
+     * they use a record returned by lookup().
+     *
+     * Firmware updated over the air keeps the old partition table,
+     * the cache is disabled if the partition does not exist.
+     */
+    class FlashCache {
+        public:
+            static const char* TAG;
+
+            typedef struct {
+                uint32_t hash;
+                String url;
+                String etag;
+                String lastModified;
+                uint32_t size;
+                uint32_t timeStored; // seconds since epoch
+                int32_t maxAge;      // ms, -1 if it must be revalidated
+                uint32_t timeUsed;   // ms since boot
+            } record_t;
+
+        private:
+            typedef struct {
+                uint32_t magic;
+                uint32_t size;
+                uint32_t timeStored;
+                int32_t maxAge;
+                uint16_t urlLength;
+                uint8_t etagLength;
+                uint8_t lastModifiedLength;
+            } file_header_t;
+
+            typedef struct {
+                String url;
+                String etag;
+                String lastModified;
+                int32_t maxAge;
+                uint8_t *body;
+                uint32_t size;
+            } store_job_t;
+
+            static const uint32_t MAGIC = 0x34364357; // "WC64"
+            static const uint8_t SEEN_SIZE = 32;
+
+            SemaphoreHandle_t m_lock = NULL;
+            store_job_t *m_deferred = NULL;
+
+            bool m_mounted = false;
+            record_t m_records[WIC64_FLASH_CACHE_ENTRIES];
+
+            uint32_t m_seen[SEEN_SIZE] = { 0 };
+            uint8_t m_seenIndex = 0;
+
+            uint32_t m_hourStarted = 0;
+            uint32_t m_bytesWrittenThisHour = 0;
+
+            uint32_t m_hits = 0;
+            uint32_t m_offlineHits = 0;
+            uint32_t m_writes = 0;
+            uint32_t m_skippedWrites = 0;
+            uint32_t m_evictions = 0;
+            uint64_t m_bytesRead = 0;
+            uint64_t m_bytesWritten = 0;
+            int64_t m_writeTime = 0; // us
+
+            static uint32_t hash(const char* url);
+            static void path(uint32_t hash, char *path);
+            static void storeJob(void *job);
+
+            void load(void);
+            bool seenBefore(uint32_t hash);
+            bool withinWriteBudget(uint32_t size);
+
+            record_t* freeRecord(void);
+            record_t* leastRecentlyUsed(void);
+            void remove(record_t *record);
+
+        public:
+            FlashCache();
+
+            bool mounted(void) { return m_mounted; }
+
+            void lock(void);
+            void unlock(void);
+
+            record_t* lookup(const char* url);
+            bool isFresh(record_t *record);
+            bool read(record_t *record, Data *response, bool offline);
+
+            bool wants(const char* url);
+            void store(const char* url, const uint8_t *body, uint32_t size,
+                const char* etag, const char* lastModified, int32_t maxAge);
+            void deferStore(const char* url, Data *response,
+                const char* etag, const char* lastModified, int32_t maxAge);
+            void startDeferredStore(bool responseSent);
+
+            String statistics(void);
+    };
+
+    extern FlashCache *flashCache;
+}
+
+#endif // WIC64_FLASH_CACHE_H
@@ -2,17 +2,23 @@
 #include "httpClient.h"
 #include "utilities.h"
 #include "settings.h"
+#include "ring.h"
+#include "worker.h"
+#include "resolver.h"
+#include "cache.h"
+#include "flashCache.h"
+#include "prefetcher.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
-#include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_tls.h"
 #include "esp_crt_bundle.h"
+#include "esp32/rom/miniz.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "esp_system.h"
 
 #include "esp_http_client.h"
@@ -25,6 +31,8 @@ namespace WiC64 {
     extern Settings *settings;
 
     HttpClient::HttpClient() {
+        m_prepared = xSemaphoreCreateBinary();
+        m_poolLock = xSemaphoreCreateMutex();
         ESP_LOGI(TAG, "HTTP client initialized");
     }
 
@@ -43,6 +51,13 @@ namespace WiC64 {
 
             case HTTP_EVENT_HEADER_SENT:
                 ESP_LOGV(TAG, "HTTP_EVENT_HEADER_SENT");
+
+                // Also sent again for each redirect
+                httpClient->m_contentEncoding = ENCODING_IDENTITY;
+                httpClient->m_etag[0] = '\0';
+                httpClient->m_lastModified[0] = '\0';
+                httpClient->m_cacheControl[0] = '\0';
+                httpClient->m_contentRangeStart = -1;
                 break;
 
             case HTTP_EVENT_ON_HEADER:
@@ -57,6 +72,36 @@ namespace WiC64 {
                 if (strcmp(event->header_key, "WiC64-Security-Token") == 0) {
                     settings->securityToken(event->header_value);
                 }
+
+                // ETag, Last-Modified and Cache-Control, see ResponseCache
+                if (strcasecmp(event->header_key, "ETag") == 0) {
+                    strlcpy(httpClient->m_etag, event->header_value, sizeof(httpClient->m_etag));
+                }
+
+                if (strcasecmp(event->header_key, "Last-Modified") == 0) {
+                    strlcpy(httpClient->m_lastModified, event->header_value, sizeof(httpClient->m_lastModified));
+                }
+
+                if (strcasecmp(event->header_key, "Cache-Control") == 0) {
+                    strlcpy(httpClient->m_cacheControl, event->header_value, sizeof(httpClient->m_cacheControl));
+                }
+
+                // Content-Range: bytes <first>-<last>/<length>
+                if (strcasecmp(event->header_key, "Content-Range") == 0 &&
+                    strncasecmp(event->header_value, "bytes ", 6) == 0 &&
+                    isdigit((unsigned char) event->header_value[6])) {
+                    httpClient->m_contentRangeStart = strtoll(event->header_value + 6, NULL, 10);
+                }
+
+                // Content-Encoding: gzip|deflate
+                if (strcasecmp(event->header_key, "Content-Encoding") == 0) {
+                    if (strcasecmp(event->header_value, "gzip") == 0) {
+                        httpClient->m_contentEncoding = ENCODING_GZIP;
+                    }
+                    else if (strcasecmp(event->header_value, "deflate") == 0) {
+                        httpClient->m_contentEncoding = ENCODING_DEFLATE;
+                    }
+                }
                 break;
 
             case HTTP_EVENT_ON_DATA:
@@ -78,6 +123,39 @@ namespace WiC64 {
         request(command, HTTP_METHOD_GET, url.c_str(), NULL);
     }
 
+    void HttpClient::getRange(Command *command, String& url, uint32_t offset, uint16_t length) {
+        m_rangeOffset = offset;
+        m_rangeLength = length;
+        m_rangeRequests++;
+
+        request(command, HTTP_METHOD_GET, url.c_str(), NULL);
+
+        m_rangeOffset = 0;
+        m_rangeLength = 0;
+    }
+
+    bool HttpClient::getOffline(Command *command, String& url) {
+        ResponseCache::entry_t *cached;
+        FlashCache::record_t *stored;
+        bool served = false;
+
+        // While WiFi is down, any stored response is better than none
+        if ((cached = responseCache->lookup(url.c_str())) != NULL) {
+            ESP_LOGW(TAG, "Offline, serving cached response");
+            responseCache->serve(cached, command->response());
+            return true;
+        }
+
+        flashCache->lock();
+        if ((stored = flashCache->lookup(url.c_str())) != NULL) {
+            ESP_LOGW(TAG, "Offline, serving response stored in flash");
+            served = flashCache->read(stored, command->response(), true);
+        }
+        flashCache->unlock();
+
+        return served;
+    }
+
     void HttpClient::postUrl(String& url) {
         strncpy(m_postUrl, url.c_str(), MAX_URL_LENGTH);
     }
@@ -86,17 +164,212 @@ namespace WiC64 {
         request(command, HTTP_METHOD_POST, m_postUrl, data);
     }
 
+    void HttpClient::send(Command *command, esp_http_client_method_t method,
+        String& url, const char* contentType, Data *body) {
+
+        m_raw = true;
+        m_contentType = contentType;
+
+        request(command, method, url.c_str(), body);
+
+        m_raw = false;
+        m_contentType = NULL;
+    }
+
+    void HttpClient::prepare(Command *command, Data *data) {
+        // Called from the userport dispatcher, so never wait here. A job
+        // preparing a connection for an aborted request is still running
+        // if the state has not returned to PREPARED_NONE.
+        if (m_postUrl[0] == '\0' || m_preparedState != PREPARED_NONE) {
+            return;
+        }
+
+        m_preparedContentLength = strlen(HEADER) + data->size() + strlen(FOOTER);
+        m_preparedLegacy = command->isLegacyRequest();
+        m_preparedAcceptEncoding = acceptsEncoding(command);
+        m_preparedClient = NULL;
+        m_preparedState = PREPARED_OPENING;
+
+        if (!workers->submit("PREPARE", prepareJob, NULL)) {
+            m_preparedState = PREPARED_NONE;
+        }
+    }
+
+    void HttpClient::prepareJob(void *unused) {
+        esp_http_client_handle_t client = NULL;
+        bool abandoned;
+
+        httpClient->openPreparedConnection();
+
+        portENTER_CRITICAL(&httpClient->m_preparedLock);
+        if ((abandoned = httpClient->m_preparedState == PREPARED_ABANDONED)) {
+            client = httpClient->m_preparedClient;
+            httpClient->m_preparedClient = NULL;
+            httpClient->m_preparedState = PREPARED_NONE;
+        } else {
+            httpClient->m_preparedState = PREPARED_OPENED;
+        }
+        portEXIT_CRITICAL(&httpClient->m_preparedLock);
+
+        if (abandoned) {
+            ESP_LOGD(TAG, "Request has been finalized, closing prepared connection");
+            closeJob(client);
+            return;
+        }
+        xSemaphoreGive(httpClient->m_prepared);
+    }
+
+    void HttpClient::closeJob(void *client) {
+        if (client != NULL) {
+            esp_http_client_close((esp_http_client_handle_t) client);
+            esp_http_client_cleanup((esp_http_client_handle_t) client);
+        }
+    }
+
+    // Called once the request has been finalized, a connection that has
+    // not been used by then is closed by a worker or by prepareJob()
+    void HttpClient::dropPreparedConnection(void) {
+        esp_http_client_handle_t client = NULL;
+        prepared_state_t state;
+
+        portENTER_CRITICAL(&m_preparedLock);
+        state = m_preparedState;
+
+        if (state == PREPARED_OPENING) {
+            m_preparedState = PREPARED_ABANDONED;
+        }
+        else if (state == PREPARED_OPENED) {
+            client = m_preparedClient;
+            m_preparedClient = NULL;
+            m_preparedState = PREPARED_NONE;
+        }
+        portEXIT_CRITICAL(&m_preparedLock);
+
+        if (state != PREPARED_OPENED) {
+            return;
+        }
+
+        // Given by prepareJob() when the state changed to PREPARED_OPENED
+        xSemaphoreTake(m_prepared, 0);
+
+        if (client != NULL && !workers->submit("CLOSE", closeJob, client)) {
+            closeJob(client);
+        }
+    }
+
+    void HttpClient::openPreparedConnection(void) {
+        esp_http_client_handle_t client;
+        char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+        IPAddress address;
+        int64_t start = esp_timer_get_time();
+
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+        esp_http_client_config_t config = {
+            .url = m_postUrl,
+            .method = HTTP_METHOD_POST,
+            .timeout_ms = (int) remoteTimeout,
+            .disable_auto_redirect = false,
+            .max_redirection_count = 10,
+            .event_handler = eventHandler,
+            .buffer_size_tx = MAX_URL_LENGTH,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+        };
+
+        #pragma GCC diagnostic pop
+
+        ESP_LOGD(TAG, "Opening connection while receiving POST data");
+
+        if (Resolver::host(m_postUrl, host, sizeof(host))) {
+            resolver->resolve(host, address);
+        }
+
+        if ((client = esp_http_client_init(&config)) == NULL) {
+            return;
+        }
+
+        // Same headers as set by request()
+        esp_http_client_set_header(client, "User-Agent",
+            m_preparedLegacy
+                ? "ESP32HTTPClient"
+                : "WiC64/" WIC64_VERSION_SHORT_STRING " (ESP32)");
+
+        esp_http_client_set_header(client, "Content-Type", "multipart/form-data;boundary=\"WiC64-Binary-Data\"");
+
+        if (m_preparedAcceptEncoding) {
+            esp_http_client_set_header(client, "Accept-Encoding", "gzip, deflate");
+        }
+
+        // Opening the connection also sends the request headers
+        if (esp_http_client_open(client, m_preparedContentLength) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to open connection while receiving POST data");
+            esp_http_client_cleanup(client);
+            return;
+        }
+
+        m_preparedTime = esp_timer_get_time() - start;
+        m_preparedClient = client;
+
+        ESP_LOGD(TAG, "Connection opened in %lldms", m_preparedTime / 1000);
+    }
+
+    esp_http_client_handle_t HttpClient::takePreparedConnection(int64_t content_length) {
+        esp_http_client_handle_t client;
+        int64_t start = esp_timer_get_time();
+
+        if (m_preparedState != PREPARED_OPENING && m_preparedState != PREPARED_OPENED) {
+            return NULL;
+        }
+
+        // Opening the connection is limited by the remote timeout
+        xSemaphoreTake(m_prepared, portMAX_DELAY);
+
+        portENTER_CRITICAL(&m_preparedLock);
+        client = m_preparedClient;
+        m_preparedClient = NULL;
+        m_preparedState = PREPARED_NONE;
+        portEXIT_CRITICAL(&m_preparedLock);
+
+        if (client != NULL && content_length != m_preparedContentLength) {
+            esp_http_client_close(client);
+            esp_http_client_cleanup(client);
+            return NULL;
+        }
+
+        if (client != NULL) {
+            m_preparedConnections++;
+
+            // Only the time spent waiting for the connection is not overlapped
+            m_overlappedTime += m_preparedTime - (esp_timer_get_time() - start);
+        }
+        return client;
+    }
+
     void HttpClient::request(Command *command, esp_http_client_method_t method, const char* url, Data* data) {
-        // content_length needs to be static because it is eventually
-        // passed by reference to the queue transfer task later on
         static int32_t content_length;
 
         int32_t size = 0;
         int32_t result;
-
-        int64_t request_content_length = method == HTTP_METHOD_POST
-            ? strlen(HEADER) + data->size() + strlen(FOOTER)
-            : 0;
+        int64_t timeOpenStarted;
+        int64_t timeOpened;
+        bool reused;
+        bool prepared;
+        ResponseCache::entry_t *cached = NULL;
+        FlashCache::record_t *stored = NULL;
+        const char* etag = NULL;
+        const char* lastModified = NULL;
+        int32_t maxAge;
+        bool noStore;
+        bool storeInFlash;
+        bool buffered;
+        bool read;
+
+        int64_t request_content_length = m_raw
+            ? (data != NULL ? data->size() : 0)
+            : method == HTTP_METHOD_POST
+                ? strlen(HEADER) + data->size() + strlen(FOOTER)
+                : 0;
 
         m_statusCode = -1;
 
@@ -118,7 +391,7 @@ namespace WiC64 {
 
         if (strlen(url) == 0) {
             ESP_LOGE(TAG, "URL not specified");
-            if (method == HTTP_METHOD_POST) {
+            if (method == HTTP_METHOD_POST && !m_raw) {
                 ESP_LOGE(TAG, "Set the URL beforehand using command 0x28 for POST requests");
             }
             command->error(Command::CLIENT_ERROR, "URL not specified", "!0");
@@ -132,11 +405,93 @@ namespace WiC64 {
             goto ERROR;
         }
 
+        if (method == HTTP_METHOD_GET && m_rangeLength == 0 && prefetcher->take(url, command->response())) {
+            m_statusCode = 200;
+            goto DONE;
+        }
+
+        // Partial responses are never cached
+        if (method == HTTP_METHOD_GET && m_rangeLength == 0 && (cached = responseCache->lookup(url)) != NULL) {
+            if (responseCache->isFresh(cached)) {
+                ESP_LOGI(TAG, "Cached response is still fresh, not sending request");
+                responseCache->serve(cached, command->response());
+                m_statusCode = 200;
+                goto DONE;
+            }
+            ESP_LOGI(TAG, "Revalidating cached response");
+            etag = cached->etag.c_str();
+            lastModified = cached->lastModified.c_str();
+        }
+
+        if (method == HTTP_METHOD_GET && m_rangeLength == 0 && cached == NULL) {
+            // The record may be replaced by a pending write, so its
+            // validators are copied while the cache is locked
+            flashCache->lock();
+            read = false;
+
+            if ((stored = flashCache->lookup(url)) != NULL &&
+                flashCache->isFresh(stored) && flashCache->read(stored, command->response(), false)) {
+                read = true;
+            }
+            // read() drops the record if the file can't be read
+            else if ((stored = flashCache->lookup(url)) != NULL) {
+                strlcpy(m_storedEtag, stored->etag.c_str(), sizeof(m_storedEtag));
+                strlcpy(m_storedLastModified, stored->lastModified.c_str(), sizeof(m_storedLastModified));
+            }
+            flashCache->unlock();
+
+            if (read) {
+                ESP_LOGI(TAG, "Response stored in flash is still fresh, not sending request");
+                m_statusCode = 200;
+                goto DONE;
+            }
+
+            if (stored != NULL) {
+                ESP_LOGI(TAG, "Revalidating response stored in flash");
+                etag = m_storedEtag;
+                lastModified = m_storedLastModified;
+            }
+        }
+
         retries = MAX_RETRIES;
         timeRequestStarted = millis();
 
+        // The queueing job of an aborted request may still be using the
+        // connection, it stops as soon as it notices, see queueJob()
+        if (!transferQueue->claim(remoteTimeout)) {
+            command->error(Command::INTERNAL_ERROR, "Previous transfer still in progress", "!0");
+            goto DONE;
+        }
+
+        // The previous request is done with its connection by now
+        checkinConnection();
+
     RETRY:
+        if (!connectionKey(url, m_clientKey, sizeof(m_clientKey))) {
+            m_clientKey[0] = '\0';
+        }
+
+        prepared = method == HTTP_METHOD_POST && !m_raw && isConnectionClosed() &&
+            (m_client = takePreparedConnection(request_content_length)) != NULL;
+
         if (isConnectionClosed()) {
+            m_client = checkoutConnection(m_clientKey);
+        }
+        reused = !prepared && !isConnectionClosed();
+
+        if (prepared) {
+            ESP_LOGI(TAG, "Using connection opened while receiving the request");
+        }
+        else if (!reused) {
+            // esp_http_client does its own lookup, but it is answered from
+            // the lwIP DNS table if the resolver has looked up the host lately
+            char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+            IPAddress address;
+
+            if (Resolver::host(url, host, sizeof(host))) {
+                resolver->resolve(host, address);
+            }
+
             ESP_LOGV(TAG, "Opening new connection");
             m_client = esp_http_client_init(&config);
 
@@ -165,13 +520,65 @@ namespace WiC64 {
                 ? "ESP32HTTPClient"
                 : "WiC64/" WIC64_VERSION_SHORT_STRING " (ESP32)");
 
-        if (method == HTTP_METHOD_POST) {
+        if (m_raw) {
+            if (m_contentType != NULL && m_contentType[0] != '\0') {
+                esp_http_client_set_header(m_client, "Content-Type", m_contentType);
+            } else if (request_content_length > 0) {
+                esp_http_client_set_header(m_client, "Content-Type", "application/octet-stream");
+            } else {
+                esp_http_client_delete_header(m_client, "Content-Type");
+            }
+        }
+        else if (method == HTTP_METHOD_POST) {
             esp_http_client_set_header(m_client, "Content-Type", "multipart/form-data;boundary=\"WiC64-Binary-Data\"");
         }
 
-        if ((result = esp_http_client_open(m_client, request_content_length) != ESP_OK)) {
+        // Compressed responses are inflated before they are sent to the C64,
+        // see acceptsEncoding(). The header has to be removed explicitly since
+        // the connection may be reused. A byte range of a compressed response
+        // can't be inflated, so ranges are always requested uncompressed.
+        if (acceptsEncoding(command) && m_rangeLength == 0) {
+            esp_http_client_set_header(m_client, "Accept-Encoding", "gzip, deflate");
+        } else {
+            esp_http_client_delete_header(m_client, "Accept-Encoding");
+        }
+
+        // Ask the server to respond with "304 Not Modified" if the cached response is still valid
+        if (etag != NULL && etag[0] != '\0') {
+            esp_http_client_set_header(m_client, "If-None-Match", etag);
+        } else {
+            esp_http_client_delete_header(m_client, "If-None-Match");
+        }
+
+        if (lastModified != NULL && lastModified[0] != '\0') {
+            esp_http_client_set_header(m_client, "If-Modified-Since", lastModified);
+        } else {
+            esp_http_client_delete_header(m_client, "If-Modified-Since");
+        }
+
+        if (m_rangeLength > 0) {
+            char range[32];
+            snprintf(range, sizeof(range), "bytes=%u-%u",
+                m_rangeOffset, m_rangeOffset + m_rangeLength - 1);
+            esp_http_client_set_header(m_client, "Range", range);
+        } else {
+            esp_http_client_delete_header(m_client, "Range");
+        }
+
+        timeOpenStarted = esp_timer_get_time();
+
+        if (!prepared && (result = esp_http_client_open(m_client, request_content_length) != ESP_OK)) {
             ESP_LOGE(TAG, "Failed to open connection: %s", esp_err_to_name(result));
 
+            if (reused && canRetry(command)) {
+                // The server has probably closed the idle connection.
+                // Still counted as a retry, the pool may hold more stale
+                // connections and each retry costs a connection attempt
+                ESP_LOGW(TAG, "Reused connection is gone, opening a new one");
+                closeConnection();
+                goto RETRY;
+            }
+
             ESP_LOGW(TAG, "Retrying %d more time%s...",
                 retries+1, (retries > 1) ? "s" : "");
 
@@ -184,15 +591,40 @@ namespace WiC64 {
             }
         }
 
-        if (method == HTTP_METHOD_POST) {
+        timeOpened = prepared ? m_preparedTime : esp_timer_get_time() - timeOpenStarted;
+
+        if (reused) {
+            // Count the time it would have taken to open a new connection,
+            // based on the average of all connections opened so far
+            if (m_connections > 0 && m_connectTime / m_connections > timeOpened) {
+                m_savedTime += m_connectTime / m_connections - timeOpened;
+            }
+        } else {
+            m_connections++;
+            m_connectTime += timeOpened;
+        }
+
+        if (isSecure()) {
+            if (reused) {
+                m_tlsReused++;
+                m_tlsReusedTime += timeOpened;
+            } else {
+                m_tlsHandshakes++;
+                m_tlsHandshakeTime += timeOpened;
+            }
+            ESP_LOGD(TAG, "%s TLS connection opened in %lldms",
+                reused ? "Reused" : "New", timeOpened / 1000);
+        }
+
+        if (m_raw ? request_content_length > 0 : method == HTTP_METHOD_POST) {
             bool success = true;
 
             if (data->isQueued()) {
                 ESP_LOGI(TAG, "Sending queued POST request body (%lld bytes)", request_content_length);
 
                 uint32_t bytes_remaining = data->size();
-                uint32_t items_remaining = WIC64_QUEUE_ITEMS_REQUIRED(bytes_remaining);
-                uint16_t size = 0;
+                uint32_t size = 0;
+                uint8_t *segment;
 
                 // If sending the header fails, we can still retry
                 if (!(success = esp_http_client_write(m_client, HEADER, strlen(HEADER))) == strlen(HEADER)) {
@@ -200,22 +632,20 @@ namespace WiC64 {
                 }
 
                 // Once we've started to receive from the queue, we can't retry any more...
-                while (items_remaining) {
-                    size = items_remaining > 1
-                        ? WIC64_QUEUE_ITEM_SIZE
-                        : bytes_remaining;
-
-                    if (!command->aborted() && xQueueReceive(data->queue(), transferQueueReceiveBuffer, pdMS_TO_TICKS(transferTimeout)) == pdTRUE) {
+                while (bytes_remaining) {
+                    if (!command->aborted() &&
+                        (size = data->queue()->acquire(&segment, bytes_remaining, transferTimeout)) > 0) {
 
-                        if (esp_http_client_write(m_client, (const char*) transferQueueReceiveBuffer, size) != size) {
+                        // Send the data straight from the queue
+                        if (esp_http_client_write(m_client, (const char*) segment, size) != (int) size) {
                             ESP_LOGE(TAG, "Failed to send POST data to server");
                             command->error(Command::NETWORK_ERROR,
                                 "Failed to send POST data to server", "!0");
                             goto ERROR;
                         }
 
+                        data->queue()->release(size);
                         bytes_remaining -= size;
-                        items_remaining -= 1;
                     }
                     else {
                         ESP_LOGE(TAG, "Failed to receive POST data from client, aborting POST request");
@@ -234,6 +664,10 @@ namespace WiC64 {
                     goto ERROR;
                 }
 
+            } else if (m_raw) {
+                ESP_LOGI(TAG, "Sending request body (%lld bytes)", request_content_length);
+                success = esp_http_client_write(m_client, (const char*) data->data(), data->size()) == data->size();
+
             } else {
                 ESP_LOGI(TAG, "Sending static POST request body (%lld bytes)", request_content_length);
                 success =
@@ -261,6 +695,12 @@ namespace WiC64 {
 
         if ((result = esp_http_client_fetch_headers(m_client)) == ESP_FAIL) {
 
+            if (reused && !command->request()->payload()->isQueued() && canRetry(command)) {
+                ESP_LOGW(TAG, "Reused connection closed by server, opening a new one");
+                closeConnection();
+                goto RETRY;
+            }
+
             if (canRetry(command) && !command->request()->payload()->isQueued()) {
                 ESP_LOGW(TAG, "Failed to fetch headers, retrying %d more time%s...",
                     retries+1, (retries > 1) ? "s" : "");
@@ -277,7 +717,7 @@ namespace WiC64 {
         m_statusCode = esp_http_client_get_status_code(m_client);
 
         ESP_LOGI(TAG, "HTTP %s Status = %d, content_length = %d",
-            method == HTTP_METHOD_GET ? "GET" : "POST",
+            methodToString(method),
             m_statusCode,
             content_length);
 
@@ -299,45 +739,193 @@ namespace WiC64 {
 
         // The previous firmware sends an error response for any status code != 200 or 201
         // There are more successful status codes, so we only send an error if code is >= 400
+        if (m_statusCode == 304 && cached != NULL) {
+            ESP_LOGI(TAG, "Cached response has not been modified");
+            responseCache->revalidated(cached, m_cacheControl);
+            responseCache->serve(cached, command->response());
+            m_statusCode = 200;
+            goto DONE;
+        }
+
+        if (m_statusCode == 304 && stored != NULL) {
+            ESP_LOGI(TAG, "Response stored in flash has not been modified");
+
+            flashCache->lock();
+            read = (stored = flashCache->lookup(url)) != NULL &&
+                flashCache->read(stored, command->response(), false);
+            flashCache->unlock();
+
+            if (!read) {
+                command->error(Command::INTERNAL_ERROR, "Failed to read response from flash", "!0");
+                goto ERROR;
+            }
+            responseCache->store(url, command->response(), etag, lastModified, m_cacheControl);
+            m_statusCode = 200;
+            goto DONE;
+        }
+
+        if (m_statusCode == 416 && m_rangeLength > 0) {
+            // The range starts beyond the end of the resource: this is not
+            // an error, the client has simply paged past the end of the file
+            ESP_LOGI(TAG, "Requested range not satisfiable, sending empty response");
+            esp_http_client_read(m_client, (char*) command->response()->data(), 0xffff);
+            command->response()->size(0);
+            goto DONE;
+        }
+
         if (m_statusCode >= 400) {
             ESP_LOGE(TAG, "Received HTTP status code %d >= 400", m_statusCode);
             command->error(Command::SERVER_ERROR, statusToString(m_statusCode), "!0");
             goto ERROR;
         }
 
-        if (content_length >= 0x10000) {
-            // Start queued transfer if content length is known and exceeds transferBuffer
+        maxAge = ResponseCache::maxAge(m_cacheControl, &noStore);
+
+        storeInFlash = method == HTTP_METHOD_GET && m_statusCode == 200 &&
+            m_rangeLength == 0 && !noStore && flashCache->wants(url);
+
+        // Responses of known length below 64kb are usually queued, but the
+        // C64 can only be sent a compressed response (see Service::compressResponse())
+        // and a response can only be cached if it has been read into the transfer buffer
+        buffered = command->request()->compressResponse() || storeInFlash ||
+            (method == HTTP_METHOD_GET && m_statusCode == 200 && content_length > 0 &&
+             ResponseCache::isCacheable(content_length, m_etag, m_lastModified, m_cacheControl));
+
+        // Responses to HEAD requests, 204 No Content and 304 Not Modified never
+        // have a body, even if they carry the Content-Length of the resource
+        if (method == HTTP_METHOD_HEAD || m_statusCode == 204 || m_statusCode == 304 ||
+            (content_length == 0 && !esp_http_client_is_chunked_response(m_client))) {
+            ESP_LOGI(TAG, "Response has no body");
+            command->response()->size(0);
+
+            // The client would expect Content-Length bytes to follow if the
+            // connection was reused, so don't keep it around
+            if (method == HTTP_METHOD_HEAD && content_length > 0) {
+                closeConnection();
+            }
+        }
+        else if (m_rangeLength > 0) {
+            if (!readRange(command)) {
+                goto ERROR;
+            }
+        }
+        else if (m_contentEncoding != ENCODING_IDENTITY &&
+                 command->supportsQueuedResponse() && command->request()->framedResponse()) {
+            // The inflated response may exceed 64kb, so it is sent in frames
+            // while it is inflated. Like any framed response, it is neither
+            // compressed for the C64 nor cached.
+            ESP_LOGI(TAG, "Starting framed send of %s encoded response data",
+                m_contentEncoding == ENCODING_GZIP ? "gzip" : "deflate");
+
+            command->response()->queue(transferQueue, WIC64_FRAMED_RESPONSE_SIZE);
+            command->responseReady();
+
+            m_queueGeneration = transferQueue->attach();
+
+            if (!workers->submit("SENDER", inflateJob, NULL)) {
+                transferQueue->detach();
+                closeConnection();
+            }
+        }
+        else if (m_contentEncoding != ENCODING_IDENTITY) {
+            // The size of the inflated response is not known in advance,
+            // so the response is inflated into the transfer buffer first
+            ESP_LOGI(TAG, "Inflating %s encoded response data (up to 64kb)",
+                m_contentEncoding == ENCODING_GZIP ? "gzip" : "deflate");
+
+            if ((size = inflate(command, command->response()->data(), 0xffff)) == -1) {
+                goto ERROR;
+            }
+            ESP_LOGI(TAG, "Inflated %d bytes", size);
+
+            command->response()->size(size);
+        }
+        else if (content_length >= 0x10000 ||
+                 (content_length > 0 && !buffered && command->canStreamResponse(content_length))) {
+            // Start queued transfer if content length is known and exceeds a transfer buffer.
+            // Unless the request uses the legacy protocol, smaller responses of known length
+            // are queued as well, so that the C64 starts receiving data as soon as the first
+            // segment arrives instead of waiting for the whole response to be downloaded.
             ESP_LOGI(TAG, "Starting queued send of %d bytes", content_length);
 
             // Set the queue and the size of the reponse in the response object
             command->response()->queue(transferQueue, (uint32_t) content_length);
 
+            // Remember how to ask for the rest of the response in case
+            // the connection drops, see resume(). Weak ETags can't be used
+            // in If-Range, and compressed responses are inflated in one go.
+            m_resumeValidator[0] = '\0';
+
+            if (method == HTTP_METHOD_GET && m_contentEncoding == ENCODING_IDENTITY) {
+                if (m_etag[0] == '"') {
+                    strlcpy(m_resumeValidator, m_etag, sizeof(m_resumeValidator));
+                }
+                else if (m_lastModified[0] != '\0') {
+                    strlcpy(m_resumeValidator, m_lastModified, sizeof(m_resumeValidator));
+                }
+                m_resumeUrl = url;
+            }
+
             // Ask the command to send the SERVICE_RESPONSE_READY event so that
             // Service will start reading and sending data down to the C64 as soon as
             // it becomes available
             command->responseReady();
 
-            // Start the queueing task that reads from the connection and inserts it at the end
-            // of the queue in chunks of WIC64_QUEUE_ITEM_SIZE. We'll pass a pointer to the
-            // content_length variable via the pvParameters argument.
-            xTaskCreatePinnedToCore(queueTask, "SENDER", 4096, &content_length, 30, NULL, 1);
+            // Start the queueing job that reads from the connection and inserts it at the end
+            // of the queue in segments of up to WIC64_QUEUE_SEGMENT_SIZE. The content length
+            // is passed by value since this function returns before the job runs.
+            m_queueGeneration = transferQueue->attach();
+
+            if (!workers->submit("SENDER", queueJob, (void*) content_length)) {
+                transferQueue->detach();
+                closeConnection();
+            }
+        }
+        else if ((content_length < 0 || esp_http_client_is_chunked_response(m_client)) &&
+                  command->supportsQueuedResponse() && command->request()->framedResponse()) {
+            // The length is not known in advance (no Content-Length or
+            // Transfer-Encoding: chunked) and the client accepts frames, so send
+            // the response in frames until the connection has no more data,
+            // see WIC64_FRAMED_RESPONSE_SIZE
+            ESP_LOGI(TAG, "Starting framed send of response data of unknown length");
+
+            command->response()->queue(transferQueue, WIC64_FRAMED_RESPONSE_SIZE);
+            command->responseReady();
+
+            // A content length of 0 tells the queueing job to read until the end
+            m_queueGeneration = transferQueue->attach();
+
+            if (!workers->submit("SENDER", queueJob, (void*) 0)) {
+                transferQueue->detach();
+                closeConnection();
+            }
         }
         else { // Content-Length <= 0xffff, not send by server or Transfer-Encoding: chunked
-            if (content_length == 0) {
+            if (content_length <= 0) {
                 ESP_LOGI(TAG, "Reading response data of unknown length (up to 64kb)");
             } else {
                 ESP_LOGI(TAG, "Reading %d bytes of response data", content_length);
             }
 
-            // Read up to 64kb from the connection into the static transfer buffer
-            if ((size = esp_http_client_read(m_client, (char*) transferBuffer, 0xffff)) == -1) {
+            // Read up to 64kb from the connection into the transfer buffer of the response
+            if ((size = esp_http_client_read(m_client, (char*) command->response()->data(), 0xffff)) == -1) {
                 ESP_LOGE(TAG, "Read error");
                 command->error(Command::NETWORK_ERROR, "Failed to read HTTP response", "!0");
                 goto ERROR;
             }
             ESP_LOGI(TAG, "Read %d bytes", size);
 
-            command->response()->set(transferBuffer, size);
+            command->response()->size(size);
+        }
+
+        // Keep a copy of static responses to GET requests
+        if (method == HTTP_METHOD_GET && m_statusCode == 200 && m_rangeLength == 0 && !command->response()->isQueued()) {
+            responseCache->store(url, command->response(), m_etag, m_lastModified, m_cacheControl);
+
+            // Written once the response has been sent, see Service::finalizeRequest()
+            if (storeInFlash) {
+                flashCache->deferStore(url, command->response(), m_etag, m_lastModified, maxAge);
+            }
         }
 
     DONE:
@@ -372,6 +960,559 @@ namespace WiC64 {
         return m_client == NULL;
     }
 
+    uint32_t HttpClient::gzipHeaderSize(const uint8_t *data, uint32_t size) {
+        // See RFC 1952, returns 0 if the header is invalid or incomplete
+        const uint8_t FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08, FCOMMENT = 0x10;
+        uint32_t pos = 10;
+        uint8_t flags;
+
+        if (size < pos || data[0] != 0x1f || data[1] != 0x8b || data[2] != 0x08) {
+            return 0;
+        }
+        flags = data[3];
+
+        if (flags & FEXTRA) {
+            if (pos + 2 > size) return 0;
+            pos += 2 + (data[pos] | (data[pos+1] << 8));
+        }
+
+        if (flags & FNAME) {
+            while (pos < size && data[pos] != 0x00) pos++;
+            pos++;
+        }
+
+        if (flags & FCOMMENT) {
+            while (pos < size && data[pos] != 0x00) pos++;
+            pos++;
+        }
+
+        if (flags & FHCRC) {
+            pos += 2;
+        }
+
+        return (pos <= size) ? pos : 0;
+    }
+
+    // Inflates the response into dst, which has to hold the complete
+    // response. If command is NULL, dst is a window of max bytes (a power
+    // of two of at least TINFL_LZ_DICT_SIZE) instead, and the output is
+    // added to the transfer queue as it is inflated, see inflateJob().
+    // The response header has already been sent then, so errors can't be
+    // reported to the C64 anymore.
+    int32_t HttpClient::inflate(Command *command, uint8_t *dst, uint32_t max) {
+        tinfl_decompressor *decompressor = NULL;
+        tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+        bool queued = (command == NULL);
+        uint32_t flags = queued
+            ? TINFL_FLAG_HAS_MORE_INPUT
+            : TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | TINFL_FLAG_HAS_MORE_INPUT;
+
+        uint8_t *input = NULL;
+        uint32_t input_offset = 0;
+        uint32_t input_available = 0;
+        uint32_t output_offset = 0;
+        uint32_t compressed = 0;
+        uint32_t inflated = 0;
+        uint32_t generation = m_queueGeneration;
+        size_t input_size, output_size;
+        int32_t bytes_read;
+        bool first = true;
+        int32_t result = -1;
+
+        decompressor = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor));
+        input = (uint8_t*) malloc(INFLATE_INPUT_SIZE);
+
+        if (decompressor == NULL || input == NULL) {
+            ESP_LOGE(TAG, "Could not allocate memory for inflating response");
+            if (!queued) command->error(Command::INTERNAL_ERROR, "Out of memory", "!0");
+            goto DONE;
+        }
+        tinfl_init(decompressor);
+
+        // A buffer holding the complete response is also used as the
+        // dictionary, only a queued response needs a separate window
+        while (status > TINFL_STATUS_DONE) {
+            if (input_available == 0) {
+                if ((bytes_read = esp_http_client_read(m_client, (char*) input, INFLATE_INPUT_SIZE)) < 0) {
+                    ESP_LOGE(TAG, "Read error");
+                    if (!queued) command->error(Command::NETWORK_ERROR, "Failed to read HTTP response", "!0");
+                    goto DONE;
+                }
+
+                if (bytes_read == 0) {
+                    flags &= ~TINFL_FLAG_HAS_MORE_INPUT;
+                }
+
+                input_offset = 0;
+                input_available = bytes_read;
+                compressed += bytes_read;
+
+                if (first) {
+                    first = false;
+
+                    if (m_contentEncoding == ENCODING_GZIP) {
+                        // The gzip trailer is not verified, the data has
+                        // already been checked on the TCP or TLS layer
+                        if ((input_offset = gzipHeaderSize(input, input_available)) == 0) {
+                            ESP_LOGE(TAG, "Invalid gzip header");
+                            if (!queued) command->error(Command::SERVER_ERROR, "Invalid gzip response", "!0");
+                            goto DONE;
+                        }
+                        input_available -= input_offset;
+                    }
+                    // "deflate" should be zlib wrapped, but some servers send raw deflate data
+                    else if (input_available >= 2 && (input[0] & 0x0f) == 0x08 &&
+                             ((input[0] << 8) | input[1]) % 31 == 0) {
+                        flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+                    }
+                }
+            }
+
+            input_size = input_available;
+            output_offset = queued ? inflated & (max - 1) : inflated;
+            output_size = max - output_offset;
+
+            status = tinfl_decompress(decompressor,
+                input + input_offset, &input_size,
+                dst, dst + output_offset, &output_size,
+                flags);
+
+            input_offset += input_size;
+            input_available -= input_size;
+            inflated += output_size;
+
+            if (queued) {
+                // The window wraps around, so the output has to be queued
+                // before the decompressor is called again
+                if (status >= TINFL_STATUS_DONE &&
+                    !queueInflated(dst + output_offset, output_size, generation)) {
+                    goto DONE;
+                }
+            }
+            else if (status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+                ESP_LOGE(TAG, "Inflated response exceeds %d bytes", max);
+                command->error(Command::CLIENT_ERROR, "Inflated response too large", "!0");
+                goto DONE;
+            }
+        }
+
+        if (status != TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Failed to inflate response (status %d)", status);
+            if (!queued) command->error(Command::SERVER_ERROR, "Invalid compressed response", "!0");
+            goto DONE;
+        }
+
+        ESP_LOGD(TAG, "Inflated %d bytes to %d bytes", compressed, inflated);
+
+        m_compressedResponses++;
+        m_compressedBytes += compressed;
+        m_inflatedBytes += inflated;
+        result = inflated;
+
+    DONE:
+        free(input);
+        free(decompressor);
+        return result;
+    }
+
+    void HttpClient::inflateJob(void *unused) {
+        uint32_t generation = httpClient->m_queueGeneration;
+        uint8_t *window;
+
+        ESP_LOGD(TAG, "Client queue task queueing inflated response of unknown length...");
+
+        if ((window = (uint8_t*) malloc(TINFL_LZ_DICT_SIZE)) == NULL) {
+            ESP_LOGE(TAG, "Could not allocate memory for inflating response");
+            httpClient->closeConnection();
+        }
+        else if (httpClient->inflate(NULL, window, TINFL_LZ_DICT_SIZE) == -1) {
+            httpClient->closeConnection();
+        }
+        else if (!transferQueue->aborted(generation)) {
+            // End of response, the consumer will send the final frame
+            transferQueue->close();
+        }
+
+        free(window);
+        transferQueue->detach();
+    }
+
+    bool HttpClient::queueInflated(const uint8_t *data, uint32_t size, uint32_t generation) {
+        uint8_t *segment;
+        uint32_t space;
+
+        while (size > 0) {
+            if (transferQueue->aborted(generation)) {
+                ESP_LOGW(TAG, "Inflated response aborted");
+                return false;
+            }
+
+            if ((space = transferQueue->reserve(&segment, MIN(size, WIC64_QUEUE_SEGMENT_SIZE), transferTimeout)) == 0) {
+                ESP_LOGW(TAG, "No space left in queue for more than %dms", transferTimeout);
+                return false;
+            }
+            memcpy(segment, data, space);
+
+            // The segment and the end of the ring belong to the next transfer now
+            if (transferQueue->aborted(generation)) {
+                return false;
+            }
+            transferQueue->commit(space);
+
+            data += space;
+            size -= space;
+        }
+        return true;
+    }
+
+    // Compressed responses are inflated before they are sent to the C64,
+    // into the transfer buffer or, if the client accepts frames, into a
+    // framed response of any length. Other extended protocol clients can
+    // be sent uncompressed responses >=64kb as queued responses of known
+    // length, so they are not offered compression that would limit them
+    // to 64kb.
+    bool HttpClient::acceptsEncoding(Command *command) {
+        return settings->compressionEnabled() &&
+            (!command->supportsQueuedResponse() || command->request()->framedResponse());
+    }
+
+    bool HttpClient::connectionKey(const char* url, char* key, size_t size) {
+        const char *scheme_end, *host, *host_end, *port;
+        const char *at;
+        int scheme_length, host_length, port_length;
+        int length;
+
+        // Reduce the URL to "<scheme>://<host>:<port>"
+        if ((scheme_end = strstr(url, "://")) == NULL) {
+            return false;
+        }
+        scheme_length = scheme_end - url;
+        host = scheme_end + 3;
+
+        host_end = host + strcspn(host, "/?#");
+
+        // skip user info
+        if ((at = (const char*) memchr(host, '@', host_end - host)) != NULL) {
+            host = at + 1;
+        }
+
+        port = (const char*) memchr(host, ':', host_end - host);
+        host_length = (port != NULL ? port : host_end) - host;
+
+        if (port != NULL) {
+            port_length = host_end - port;
+        } else {
+            port = (scheme_length == 5 && strncasecmp(url, "https", 5) == 0) ? ":443" : ":80";
+            port_length = strlen(port);
+        }
+
+        length = snprintf(key, size, "%.*s://%.*s%.*s",
+            scheme_length, url,
+            host_length, host,
+            port_length, port);
+
+        if (length < 0 || length >= (int) size) {
+            return false;
+        }
+
+        for (char *c = key; *c != '\0'; c++) {
+            *c = tolower(*c);
+        }
+        return true;
+    }
+
+    void HttpClient::loop(void) {
+        if (millis() - loop_ms >= POOL_LOOP_INTERVAL) {
+            loop_ms = millis();
+
+            // Never wait for a request that is using the pool
+            if (xSemaphoreTake(m_poolLock, 0) == pdTRUE) {
+                closeIdleConnections();
+                xSemaphoreGive(m_poolLock);
+            }
+        }
+    }
+
+    esp_http_client_handle_t HttpClient::checkoutConnection(const char* key) {
+        esp_http_client_handle_t client = NULL;
+
+        xSemaphoreTake(m_poolLock, portMAX_DELAY);
+        closeIdleConnections();
+
+        if (key[0] != '\0') {
+            for (uint8_t i=0; i<POOL_SIZE; i++) {
+                if (m_pool[i].client != NULL && strcmp(m_pool[i].key, key) == 0) {
+                    ESP_LOGD(TAG, "Reusing connection to %s", key);
+
+                    client = m_pool[i].client;
+                    m_pool[i].client = NULL;
+                    m_poolHits++;
+                    break;
+                }
+            }
+        }
+
+        if (client == NULL) {
+            m_poolMisses++;
+        }
+        xSemaphoreGive(m_poolLock);
+
+        return client;
+    }
+
+    void HttpClient::checkinConnection(void) {
+        char url[MAX_KEY_LENGTH+1];
+        pooled_connection_t *slot = NULL;
+
+        if (isConnectionClosed()) {
+            return;
+        }
+
+        // Only keep connections with no response data left to read that
+        // are still connected to the requested host, a redirect may have
+        // moved the connection to another one. esp_http_client_get_url()
+        // only returns "<scheme>://<host>".
+        if (m_clientKey[0] == '\0' ||
+            !esp_http_client_is_complete_data_received(m_client) ||
+            esp_http_client_get_url(m_client, url, sizeof(url)) != ESP_OK ||
+            strncasecmp(m_clientKey, url, strlen(url)) != 0 ||
+            m_clientKey[strlen(url)] != ':') {
+            closeConnection();
+            return;
+        }
+
+        xSemaphoreTake(m_poolLock, portMAX_DELAY);
+
+        // A connection to the same host has been opened while another one
+        // was pooled, keep only the newer one instead of a duplicate entry
+        for (uint8_t i=0; i<POOL_SIZE; i++) {
+            if (m_pool[i].client != NULL && strcmp(m_pool[i].key, m_clientKey) == 0) {
+                ESP_LOGD(TAG, "Replacing pooled connection to %s", m_pool[i].key);
+                closePooledConnection(&m_pool[i]);
+                slot = &m_pool[i];
+                break;
+            }
+        }
+
+        if (slot == NULL) {
+            for (uint8_t i=0; i<POOL_SIZE; i++) {
+                if (m_pool[i].client == NULL) {
+                    slot = &m_pool[i];
+                    break;
+                }
+                if (slot == NULL || m_pool[i].lastUsed < slot->lastUsed) {
+                    slot = &m_pool[i];
+                }
+            }
+
+            if (slot->client != NULL) {
+                ESP_LOGD(TAG, "Evicting least recently used connection to %s", slot->key);
+                closePooledConnection(slot);
+                m_poolEvictions++;
+            }
+        }
+
+        strcpy(slot->key, m_clientKey);
+
+        ESP_LOGV(TAG, "Keeping connection to %s", slot->key);
+        slot->client = m_client;
+        slot->lastUsed = millis();
+        m_client = NULL;
+
+        xSemaphoreGive(m_poolLock);
+    }
+
+    // The caller has to hold m_poolLock
+    void HttpClient::closeIdleConnections(void) {
+        for (uint8_t i=0; i<POOL_SIZE; i++) {
+            if (m_pool[i].client != NULL && millis() - m_pool[i].lastUsed > POOL_IDLE_TIMEOUT) {
+                ESP_LOGD(TAG, "Closing idle connection to %s", m_pool[i].key);
+                closePooledConnection(&m_pool[i]);
+            }
+        }
+    }
+
+    void HttpClient::closePooledConnection(pooled_connection_t *connection) {
+        esp_http_client_close(connection->client);
+        esp_http_client_cleanup(connection->client);
+        connection->client = NULL;
+    }
+
+    bool HttpClient::readRange(Command *command) {
+        char *buffer = (char*) command->response()->data();
+        uint32_t skip = 0;
+        int32_t size;
+
+        if (m_statusCode != 206) {
+            // The server ignored the Range header and sends the whole
+            // response, so everything before the range is read and dropped
+            ESP_LOGW(TAG, "Server ignored range request, skipping %u bytes", m_rangeOffset);
+            m_rangesIgnored++;
+            skip = m_rangeOffset;
+        }
+        else if (m_contentRangeStart != m_rangeOffset) {
+            ESP_LOGE(TAG, "Server sent range starting at offset %lld instead of %u",
+                m_contentRangeStart, m_rangeOffset);
+            command->error(Command::SERVER_ERROR, "Server sent wrong range", "!0");
+            return false;
+        }
+
+        while (skip > 0) {
+            if ((size = esp_http_client_read(m_client, buffer, skip < 0xffff ? skip : 0xffff)) == -1) {
+                ESP_LOGE(TAG, "Read error");
+                command->error(Command::NETWORK_ERROR, "Failed to read HTTP response", "!0");
+                return false;
+            }
+
+            if (size == 0) {
+                // The range starts beyond the end of the response
+                command->response()->size(0);
+                return true;
+            }
+            skip -= size;
+        }
+
+        ESP_LOGI(TAG, "Reading %d bytes of response data starting at offset %u",
+            m_rangeLength, m_rangeOffset);
+
+        if ((size = esp_http_client_read(m_client, buffer, m_rangeLength)) == -1) {
+            ESP_LOGE(TAG, "Read error");
+            command->error(Command::NETWORK_ERROR, "Failed to read HTTP response", "!0");
+            return false;
+        }
+        ESP_LOGI(TAG, "Read %d bytes", size);
+
+        command->response()->size(size);
+
+        if (!esp_http_client_is_complete_data_received(m_client)) {
+            // Don't download the rest of the response just to keep the connection
+            closeConnection();
+        }
+        return true;
+    }
+
+    bool HttpClient::resume(uint32_t offset) {
+        char range[24];
+        const char* validator;
+        int32_t status;
+
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+        esp_http_client_config_t config = {
+            .url = m_resumeUrl.c_str(),
+            .method = HTTP_METHOD_GET,
+            .timeout_ms = (int) remoteTimeout,
+            .disable_auto_redirect = false,
+            .max_redirection_count = 10,
+            .event_handler = eventHandler,
+            .buffer_size_tx = MAX_URL_LENGTH,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+        };
+
+        #pragma GCC diagnostic pop
+
+        ESP_LOGW(TAG, "Connection lost, resuming response at offset %u", offset);
+        closeConnection();
+
+        // Give a weak WiFi connection a moment to recover
+        vTaskDelay(pdMS_TO_TICKS(RESUME_DELAY));
+
+        if ((m_client = esp_http_client_init(&config)) == NULL) {
+            ESP_LOGE(TAG, "Failed to create esp_http_client");
+            goto ERROR;
+        }
+
+        // Queued responses are never sent for legacy requests
+        esp_http_client_set_header(m_client, "User-Agent", "WiC64/" WIC64_VERSION_SHORT_STRING " (ESP32)");
+
+        snprintf(range, sizeof(range), "bytes=%u-", offset);
+        esp_http_client_set_header(m_client, "Range", range);
+
+        // The server sends the whole response instead if it has changed
+        esp_http_client_set_header(m_client, "If-Range", m_resumeValidator);
+
+        if (esp_http_client_open(m_client, 0) != ESP_OK ||
+            esp_http_client_fetch_headers(m_client) == ESP_FAIL) {
+            ESP_LOGE(TAG, "Failed to send request for remaining response data");
+            goto ERROR;
+        }
+
+        if ((status = esp_http_client_get_status_code(m_client)) != 206) {
+            ESP_LOGE(TAG, "Can't resume response, server responded with status code %d", status);
+            goto ERROR;
+        }
+
+        if (m_contentRangeStart != offset) {
+            ESP_LOGE(TAG, "Can't resume response, server sent range starting at offset %lld",
+                m_contentRangeStart);
+            goto ERROR;
+        }
+
+        // Not all servers implement If-Range, so check the validator as well
+        validator = m_resumeValidator[0] == '"' ? m_etag : m_lastModified;
+
+        if (strcmp(validator, m_resumeValidator) != 0) {
+            ESP_LOGE(TAG, "Can't resume response, resource has changed");
+            goto ERROR;
+        }
+
+        m_resumes++;
+        m_resumedBytes += offset;
+        ESP_LOGI(TAG, "Resumed response at offset %u", offset);
+        return true;
+
+    ERROR:
+        m_resumesFailed++;
+        closeConnection();
+        return false;
+    }
+
+    String HttpClient::statistics(void) {
+        char statistics[720];
+        int length;
+
+        length = snprintf(statistics, sizeof(statistics),
+            "HTTP connections: %d opened, avg %lldms to connect, pool %d hits, %d misses, "
+            "%d evictions, approx. %lldms saved by reusing connections\n",
+            m_connections,
+            m_connections ? m_connectTime / m_connections / 1000 : 0,
+            m_poolHits,
+            m_poolMisses,
+            m_poolEvictions,
+            m_savedTime / 1000);
+
+        length += snprintf(statistics + length, sizeof(statistics) - length,
+            "TLS: %d full handshakes, avg %lldms, %d connections reused, avg %lldms\n",
+            m_tlsHandshakes,
+            m_tlsHandshakes ? m_tlsHandshakeTime / m_tlsHandshakes / 1000 : 0,
+            m_tlsReused,
+            m_tlsReused ? m_tlsReusedTime / m_tlsReused / 1000 : 0);
+
+        length += snprintf(statistics + length, sizeof(statistics) - length,
+            "POST: %d connections opened while receiving data, approx. %lldms overlapped\n",
+            m_preparedConnections,
+            m_overlappedTime / 1000);
+
+        length += snprintf(statistics + length, sizeof(statistics) - length,
+            "Ranges: %d requests, %d ignored by the server, "
+            "%d interrupted responses resumed, %d failed to resume, %llu bytes not fetched again\n",
+            m_rangeRequests,
+            m_rangesIgnored,
+            m_resumes,
+            m_resumesFailed,
+            m_resumedBytes);
+
+        snprintf(statistics + length, sizeof(statistics) - length,
+            "Compression: %s, %d compressed responses, %llu bytes inflated to %llu bytes",
+            settings->compressionEnabled() ? "enabled" : "disabled",
+            m_compressedResponses,
+            m_compressedBytes,
+            m_inflatedBytes);
+
+        return String(statistics);
+    }
+
     bool HttpClient::canRetry(Command* command) {
         uint32_t elapsed = millis() - timeRequestStarted;
 
@@ -387,33 +1528,101 @@ namespace WiC64 {
         return false;
     }
 
-    void HttpClient::queueTask(void *content_length_ptr) {
-        int32_t content_length = *((int32_t *) content_length_ptr);
+    void HttpClient::queueJob(void *content_length_arg) {
+        int32_t content_length = (int32_t) content_length_arg;
+        bool framed = (content_length == 0);
+        uint32_t generation = httpClient->m_queueGeneration;
 
         int32_t bytes_read = 0;
         int32_t total_bytes_read = 0;
-        ESP_LOGD(TAG, "Client queue task queueing %d bytes...", content_length);
+        uint32_t space;
+        uint8_t *segment;
+        uint8_t resumes = 0;
+        bool resumed;
+
+        if (framed) {
+            ESP_LOGD(TAG, "Client queue task queueing response of unknown length...");
+        } else {
+            ESP_LOGD(TAG, "Client queue task queueing %d bytes...", content_length);
+        }
 
         do {
-            bytes_read = esp_http_client_read(httpClient->handle(), (char*) transferQueueSendBuffer, WIC64_QUEUE_ITEM_SIZE);
+            // The request has been finalized, nobody is waiting for more data
+            if (transferQueue->aborted(generation)) {
+                ESP_LOGW(TAG, "Response aborted after %d bytes", total_bytes_read);
+                httpClient->closeConnection();
+                break;
+            }
 
-            if (bytes_read == -1) {
-                ESP_LOGE(TAG, "Read Error");
+            // Read from the connection straight into the queue
+            space = transferQueue->reserve(&segment,
+                framed
+                    ? WIC64_QUEUE_SEGMENT_SIZE
+                    : MIN(content_length - total_bytes_read, WIC64_QUEUE_SEGMENT_SIZE),
+                transferTimeout);
+
+            if (space == 0) {
+                ESP_LOGW(TAG, "No space left in queue for more than %dms", transferTimeout);
                 httpClient->closeConnection();
                 break;
             }
-            ESP_LOGV(TAG, "Queueing %d bytes", WIC64_QUEUE_ITEM_SIZE);
-            if (xQueueSend(transferQueue, transferQueueSendBuffer, pdMS_TO_TICKS(transferTimeout)) != pdTRUE) {
-                ESP_LOGW(TAG, "Could not send to queue for more than %dms", transferTimeout);
+
+            bytes_read = esp_http_client_read(httpClient->handle(), (char*) segment, space);
+
+            // The connection was lost before the end of the response,
+            // continue with a new request for the remaining bytes
+            if (bytes_read <= 0 && !framed && httpClient->resumable() && resumes < MAX_RESUMES &&
+                !transferQueue->aborted(generation)) {
+                resumes++;
+
+                // Keeps the consumer waiting while the connection is reopened
+                transferQueue->stalled(true);
+                resumed = httpClient->resume(total_bytes_read);
+                transferQueue->stalled(false);
+
+                if (resumed) {
+                    continue;
+                }
+                ESP_LOGW(TAG, "Failed to resume response at offset %d", total_bytes_read);
+            }
+
+            // The segment and the end of the ring belong to the next transfer now
+            if (transferQueue->aborted(generation)) {
+                continue;
+            }
+
+            if (bytes_read == 0 && framed) {
+                // End of response, the consumer will send the final frame
+                ESP_LOGD(TAG, "End of response data after %d bytes", total_bytes_read);
+                transferQueue->close();
+                break;
+            }
+
+            if (bytes_read <= 0) {
+                ESP_LOGE(TAG, "Read Error");
                 httpClient->closeConnection();
                 break;
             }
+            ESP_LOGV(TAG, "Queueing %d bytes", bytes_read);
+            transferQueue->commit(bytes_read);
             total_bytes_read += bytes_read;
 
-        } while (total_bytes_read < content_length);
+        } while (framed || total_bytes_read < content_length);
 
-        ESP_LOGV(TAG, "Queueing task deleting itself");
-        vTaskDelete(NULL);
+        transferQueue->detach();
+        ESP_LOGV(TAG, "Queueing job done after %d bytes", total_bytes_read);
+    }
+
+    const char *HttpClient::methodToString(esp_http_client_method_t method) {
+        switch (method) {
+            case HTTP_METHOD_GET: return "GET";
+            case HTTP_METHOD_POST: return "POST";
+            case HTTP_METHOD_PUT: return "PUT";
+            case HTTP_METHOD_PATCH: return "PATCH";
+            case HTTP_METHOD_DELETE: return "DELETE";
+            case HTTP_METHOD_HEAD: return "HEAD";
+            default: return "?";
+        }
     }
 
     const char *HttpClient::statusToString(int32_t code)
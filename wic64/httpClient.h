@@ -3,6 +3,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_http_client.h"
 #include "WString.h"
@@ -21,6 +22,132 @@ namespace WiC64 {
             static const uint16_t MAX_URL_LENGTH = 0x2000;
             static const uint8_t MAX_RETRIES = 3;
 
+            // Compressed responses are read in chunks of this size and
+            // inflated straight into the response buffer, or through a
+            // TINFL_LZ_DICT_SIZE window into a framed response
+            static const uint16_t INFLATE_INPUT_SIZE = 0x1000;
+
+            enum content_encoding_t {
+                ENCODING_IDENTITY,
+                ENCODING_GZIP,
+                ENCODING_DEFLATE,
+            };
+            content_encoding_t m_contentEncoding = ENCODING_IDENTITY;
+
+            // Response headers used by the response cache
+            char m_etag[128] = { '\0' };
+            char m_lastModified[48] = { '\0' };
+            char m_cacheControl[128] = { '\0' };
+
+            // Validators of the response stored in flash, copied
+            // since the record may change once the cache is unlocked
+            char m_storedEtag[128] = { '\0' };
+            char m_storedLastModified[48] = { '\0' };
+
+            // Byte range requested using getRange(), a length
+            // of 0 requests the whole response as usual
+            uint32_t m_rangeOffset = 0;
+            uint16_t m_rangeLength = 0;
+
+            // First byte position of a 206 response as stated by its
+            // Content-Range header, -1 if the header is missing
+            int64_t m_contentRangeStart = -1;
+
+            // Set by send(): the body is sent as is instead of being
+            // wrapped in the multipart HEADER and FOOTER
+            bool m_raw = false;
+            const char* m_contentType = NULL;
+
+            uint32_t m_rangeRequests = 0;
+            uint32_t m_rangesIgnored = 0;
+
+            // A queued GET response that is interrupted is resumed with a
+            // new request for the remaining bytes, provided the response
+            // has a validator (strong ETag or Last-Modified) to make sure
+            // the remaining bytes belong to the same version of the resource
+            static const uint8_t MAX_RESUMES = 5;
+            static const uint16_t RESUME_DELAY = 500; // ms
+
+            String m_resumeUrl;
+            char m_resumeValidator[128] = { '\0' };
+
+            // Transfer the queueing job has been started for, see Ring::attach()
+            uint32_t m_queueGeneration = 0;
+
+            uint32_t m_resumes = 0;
+            uint32_t m_resumesFailed = 0;
+            uint64_t m_resumedBytes = 0;
+
+            uint32_t m_compressedResponses = 0;
+            uint64_t m_compressedBytes = 0;
+            uint64_t m_inflatedBytes = 0;
+
+            // Idle keep-alive connections are kept in a small LRU pool,
+            // keyed by scheme, host and port, so that requests alternating
+            // between several hosts don't have to reconnect every time
+            static const uint8_t POOL_SIZE = 3;
+            static const uint32_t POOL_IDLE_TIMEOUT = 30000; // ms
+            static const uint32_t POOL_LOOP_INTERVAL = 1000; // ms
+            static const uint8_t MAX_KEY_LENGTH = 127;
+
+            typedef struct {
+                esp_http_client_handle_t client;
+                char key[MAX_KEY_LENGTH+1];
+                uint32_t lastUsed;
+            } pooled_connection_t;
+
+            // Idle connections are also closed from loop(), which runs
+            // on the Arduino loop task, so the pool is guarded by a mutex
+            SemaphoreHandle_t m_poolLock = NULL;
+            uint32_t loop_ms = 0;
+
+            pooled_connection_t m_pool[POOL_SIZE] = { };
+            char m_clientKey[MAX_KEY_LENGTH+1] = { '\0' };
+
+            uint32_t m_poolHits = 0;
+            uint32_t m_poolMisses = 0;
+            uint32_t m_poolEvictions = 0;
+            uint32_t m_connections = 0;
+            int64_t m_connectTime = 0; // us spent opening new connections
+            int64_t m_savedTime = 0;   // us saved by reusing connections
+
+            // Statistics only, there is no TLS session cache: esp_http_client
+            // does not expose the esp-tls session in this IDF version, so an
+            // HTTPS connection only skips the full handshake by being reused
+            // from the pool
+            uint32_t m_tlsHandshakes = 0;
+            uint32_t m_tlsReused = 0;
+            int64_t m_tlsHandshakeTime = 0; // us
+            int64_t m_tlsReusedTime = 0;    // us
+
+            bool isSecure(void) { return strncmp(m_clientKey, "https:", 6) == 0; }
+
+            // The connection for a POST request is opened by a worker while
+            // the request body is being received from the C64, see prepare()
+            enum prepared_state_t {
+                PREPARED_NONE,
+                PREPARED_OPENING,
+                PREPARED_OPENED,
+                PREPARED_ABANDONED, // closed by prepareJob() once opened
+            };
+
+            SemaphoreHandle_t m_prepared = NULL;
+            portMUX_TYPE m_preparedLock = portMUX_INITIALIZER_UNLOCKED;
+            volatile prepared_state_t m_preparedState = PREPARED_NONE;
+            esp_http_client_handle_t m_preparedClient = NULL;
+            int64_t m_preparedContentLength = 0;
+            bool m_preparedLegacy = false;
+            bool m_preparedAcceptEncoding = false;
+            int64_t m_preparedTime = 0; // us
+
+            uint32_t m_preparedConnections = 0;
+            int64_t m_overlappedTime = 0; // us
+
+            static void prepareJob(void* unused);
+            static void closeJob(void* client);
+            void openPreparedConnection(void);
+            esp_http_client_handle_t takePreparedConnection(int64_t content_length);
+
             int32_t m_statusCode = -1;
             char m_postUrl[MAX_URL_LENGTH+1] = { '\0' };
 
@@ -29,6 +156,7 @@ namespace WiC64 {
 
             bool canRetry(Command* command);
             const char* statusToString(int32_t code);
+            static const char* methodToString(esp_http_client_method_t method);
             esp_http_client_handle_t handle() { return m_client; }
 
             const char* HEADER = "--WiC64-Binary-Data\nContent-Disposition: form-data; name=\"data\"" CRLF CRLF;
@@ -37,19 +165,44 @@ namespace WiC64 {
             void closeConnection(void);
             bool isConnectionClosed();
 
+            static bool connectionKey(const char* url, char* key, size_t size);
+            esp_http_client_handle_t checkoutConnection(const char* key);
+            void checkinConnection(void);
+            void closeIdleConnections(void);
+            void closePooledConnection(pooled_connection_t *connection);
+
+            static uint32_t gzipHeaderSize(const uint8_t *data, uint32_t size);
+            int32_t inflate(Command *command, uint8_t *dst, uint32_t max);
+            static void inflateJob(void* unused);
+            bool queueInflated(const uint8_t *data, uint32_t size, uint32_t generation);
+            bool acceptsEncoding(Command *command);
+            bool readRange(Command *command);
+
+            bool resumable(void) { return m_resumeValidator[0] != '\0'; }
+            bool resume(uint32_t offset);
+
             static esp_err_t eventHandler(esp_http_client_event_t *evt);
-            static void queueTask(void* content_length_ptr);
+            static void queueJob(void* content_length_arg);
 
             void request(Command *command, esp_http_client_method_t method, const char* url, Data* data);
 
         public:
             HttpClient();
             int32_t statusCode() { return m_statusCode; }
+            void loop(void);
 
             void get(Command* command, String& url);
+            bool getOffline(Command* command, String& url);
+            void getRange(Command* command, String& url, uint32_t offset, uint16_t length);
             const char* postUrl(void) { return m_postUrl; }
             void postUrl(String& url);
             void postData(Command* command, Data* data);
+            void prepare(Command* command, Data* data);
+            void dropPreparedConnection(void);
+            void send(Command* command, esp_http_client_method_t method,
+                String& url, const char* contentType, Data* body);
+
+            String statistics(void);
     };
 }
 
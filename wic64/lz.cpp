@@ -0,0 +1,227 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+#include "lz.h"
+#include "utilities.h"
+
+#define WIC64_LZ_BENCHMARK_SIZE 0x4000
+
+namespace WiC64 {
+    const char* Lz::TAG = "LZ";
+
+    uint32_t Lz::hash(const uint8_t *data) {
+        uint32_t value = (data[0] << 16) | (data[1] << 8) | data[2];
+        return (value * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    bool Lz::literals(const uint8_t *src, uint32_t count, uint8_t *dst, uint32_t *out, uint32_t max) {
+        uint32_t run;
+
+        while (count > 0) {
+            run = MIN(count, MAX_LITERALS);
+
+            if (*out + 1 + run > max) {
+                return false;
+            }
+            dst[(*out)++] = run;
+            memcpy(dst + *out, src, run);
+
+            *out += run;
+            src += run;
+            count -= run;
+        }
+        return true;
+    }
+
+    uint32_t Lz::compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+        uint16_t *table;
+        uint32_t in = 0;
+        uint32_t out = 0;
+        uint32_t pending = 0; // start of literals not yet written
+        uint32_t candidate, offset, length;
+
+        // Positions are stored as 16 bit values, so larger input
+        // would produce offsets that can't be encoded
+        if (size > 0xffff) {
+            return 0;
+        }
+
+        if ((table = (uint16_t*) calloc(1 << HASH_BITS, sizeof(uint16_t))) == NULL) {
+            ESP_LOGE(TAG, "Could not allocate hash table");
+            return 0;
+        }
+
+        while (in + MIN_MATCH <= size) {
+            uint32_t h = hash(src + in);
+            candidate = table[h];
+            table[h] = in;
+
+            // Hash collisions are sorted out by comparing the data
+            if (candidate >= in || memcmp(src + candidate, src + in, MIN_MATCH) != 0) {
+                in++;
+                continue;
+            }
+
+            length = MIN_MATCH;
+            while (length < MAX_MATCH && in + length < size && src[candidate + length] == src[in + length]) {
+                length++;
+            }
+            offset = in - candidate;
+
+            if (!literals(src + pending, in - pending, dst, &out, max) || out + 3 > max) {
+                goto OVERFLOW;
+            }
+            dst[out++] = MATCH | (length - MIN_MATCH);
+            dst[out++] = LOWBYTE(offset);
+            dst[out++] = HIGHBYTE(offset);
+
+            // Also index the positions covered by the match
+            for (uint32_t i=in+1; i<in+length && i+MIN_MATCH <= size; i++) {
+                table[hash(src + i)] = i;
+            }
+            in += length;
+            pending = in;
+        }
+
+        if (!literals(src + pending, size - pending, dst, &out, max) || out + 1 > max) {
+            goto OVERFLOW;
+        }
+        dst[out++] = END;
+
+        free(table);
+        return out;
+
+    OVERFLOW:
+        free(table);
+        return 0;
+    }
+
+    int32_t Lz::decompress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+        uint32_t in = 0;
+        uint32_t out = 0;
+        uint32_t offset, length;
+        uint8_t token;
+
+        while (in < size) {
+            token = src[in++];
+
+            if (token == END) {
+                return out;
+            }
+
+            if (token < MATCH) {
+                if (in + token > size || out + token > max) {
+                    return -1;
+                }
+                memcpy(dst + out, src + in, token);
+                in += token;
+                out += token;
+                continue;
+            }
+
+            if (in + 2 > size) {
+                return -1;
+            }
+            length = (token & ~MATCH) + MIN_MATCH;
+            offset = src[in] | (src[in+1] << 8);
+            in += 2;
+
+            if (offset == 0 || offset > out || out + length > max) {
+                return -1;
+            }
+
+            // byte by byte, matches may overlap
+            for (uint32_t i=0; i<length; i++, out++) {
+                dst[out] = dst[out - offset];
+            }
+        }
+
+        // end marker missing
+        return -1;
+    }
+
+    /* Benchmark: compress samples of text, screen memory and random
+     * data, then decompress them using the reference decoder and
+     * compare the result with the original data.
+     */
+    String Lz::benchmark(void) {
+        static const char* words[] = {
+            "the ", "commodore ", "64 ", "wic64 ", "loads ", "programs ", "from ",
+            "internet ", "and ", "a ", "of ", "disk ", "ready.\n", "basic ", "screen ",
+        };
+
+        uint8_t *sample = (uint8_t*) malloc(WIC64_LZ_BENCHMARK_SIZE);
+        uint8_t *compressed = (uint8_t*) malloc(WIC64_LZ_BENCHMARK_SIZE + WIC64_LZ_BENCHMARK_SIZE / 64 + 1);
+        uint8_t *decompressed = (uint8_t*) malloc(WIC64_LZ_BENCHMARK_SIZE);
+
+        String result = "LZ compression benchmark (" + String(WIC64_LZ_BENCHMARK_SIZE) + " bytes per sample)\n";
+        char line[120];
+
+        if (sample == NULL || compressed == NULL || decompressed == NULL) {
+            result += "Could not allocate benchmark buffers\n";
+            goto DONE;
+        }
+
+        for (uint8_t type=0; type<3; type++) {
+            const char* name;
+            uint32_t size;
+            int32_t decompressedSize;
+            int64_t start, compressTime, decompressTime;
+
+            switch (type) {
+                case 0: // text
+                    name = "Text";
+                    for (uint32_t i=0; i<WIC64_LZ_BENCHMARK_SIZE; ) {
+                        const char* word = words[esp_random() % (sizeof(words) / sizeof(words[0]))];
+                        for (; *word != '\0' && i<WIC64_LZ_BENCHMARK_SIZE; word++, i++) {
+                            sample[i] = *word;
+                        }
+                    }
+                    break;
+
+                case 1: // screen memory: mostly spaces with a few lines of text
+                    name = "Screen";
+                    for (uint32_t i=0; i<WIC64_LZ_BENCHMARK_SIZE; i++) {
+                        sample[i] = ((i % 1000) / 40) % 4 == 0 ? 'A' + (esp_random() % 26) : ' ';
+                    }
+                    break;
+
+                default:
+                    name = "Random";
+                    esp_fill_random(sample, WIC64_LZ_BENCHMARK_SIZE);
+                    break;
+            }
+
+            start = esp_timer_get_time();
+            size = compress(sample, WIC64_LZ_BENCHMARK_SIZE, compressed,
+                WIC64_LZ_BENCHMARK_SIZE + WIC64_LZ_BENCHMARK_SIZE / 64 + 1);
+            compressTime = esp_timer_get_time() - start;
+
+            start = esp_timer_get_time();
+            decompressedSize = decompress(compressed, size, decompressed, WIC64_LZ_BENCHMARK_SIZE);
+            decompressTime = esp_timer_get_time() - start;
+
+            snprintf(line, sizeof(line),
+                "%-6s: %5d bytes (%3d%%), compressed in %lldus, decompressed in %lldus, %s\n",
+                name,
+                size,
+                size * 100 / WIC64_LZ_BENCHMARK_SIZE,
+                compressTime,
+                decompressTime,
+                (decompressedSize == WIC64_LZ_BENCHMARK_SIZE &&
+                 memcmp(sample, decompressed, WIC64_LZ_BENCHMARK_SIZE) == 0) ? "OK" : "MISMATCH");
+
+            result += line;
+        }
+
+    DONE:
+        free(sample);
+        free(compressed);
+        free(decompressed);
+        return result;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef WIC64_LZ_H
+#define WIC64_LZ_H
+
+#include <cstdint>
+#include "WString.h"
+
+namespace WiC64 {
+
+    /* Byte aligned LZ compression for responses sent to the C64,
+     * designed to be decoded by a small and fast 6502 routine:
+     *
+     *   $00         end of data
+     *   $01-$7f n   n literal bytes follow
+     *   $80-$ff t   copy (t & $7f) + 3 bytes from <offset> bytes back,
+     *               the offset follows as 16 bit little endian value
+     *
+     * Matches may overlap the bytes being decoded, so the decoder must
+     * copy matches byte by byte in ascending order.
+     */
+    class Lz {
+        public:
+            static const char* TAG;
+
+            static const uint8_t END = 0x00;
+            static const uint8_t MAX_LITERALS = 0x7f;
+            static const uint8_t MATCH = 0x80;
+            static const uint8_t MIN_MATCH = 3;
+            static const uint8_t MAX_MATCH = 0x7f + MIN_MATCH;
+
+        private:
+            static const uint8_t HASH_BITS = 12;
+
+            static uint32_t hash(const uint8_t *data);
+            static bool literals(const uint8_t *src, uint32_t count, uint8_t *dst, uint32_t *out, uint32_t max);
+
+        public:
+            // Returns the compressed size, or 0 if the compressed
+            // data would exceed max bytes
+            static uint32_t compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max);
+
+            // Reference decoder, returns the decompressed size or -1
+            // if the compressed data is invalid
+            static int32_t decompress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max);
+
+            static String benchmark(void);
+    };
+}
+
+#endif // WIC64_LZ_H
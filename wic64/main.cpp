@@ -10,4 +10,5 @@ void loop() {
     webserver->loop();
     buttons->loop();
     display->loop();
+    httpClient->loop();
 }
@@ -5,11 +5,13 @@
 #include "webserver.h"
 #include "buttons.h"
 #include "display.h"
+#include "httpClient.h"
 
 namespace WiC64 {
     extern Webserver *webserver;
     extern Buttons   *buttons;
     extern Display   *display;
+    extern HttpClient *httpClient;
 }
 
 #endif // WIC64_MAIN_H
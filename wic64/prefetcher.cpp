@@ -0,0 +1,341 @@
+#include <cstring>
+#include <cstdlib>
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+
+#include "wic64.h"
+#include "prefetcher.h"
+#include "resolver.h"
+#include "connection.h"
+#include "utilities.h"
+
+#define WIC64_PREFETCH_MAX_ENTRY_SIZE (WIC64_PREFETCH_MEMORY / 2)
+
+namespace WiC64 {
+    const char* Prefetcher::TAG = "PREFETCH";
+
+    extern Connection *connection;
+
+    Prefetcher::Prefetcher() {
+        for (uint8_t i=0; i<WIC64_PREFETCH_ENTRIES; i++) {
+            m_entries[i].body = NULL;
+            m_entries[i].size = 0;
+        }
+
+        if ((m_mutex = xSemaphoreCreateMutex()) == NULL ||
+            (m_queue = xQueueCreate(WIC64_PREFETCH_QUEUE_SIZE, sizeof(char*))) == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create prefetch queue");
+            return;
+        }
+
+        xTaskCreatePinnedToCore(task, "PREFETCH", 8192, this, WIC64_PREFETCH_PRIORITY, &m_task, 1);
+
+        if (m_task == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create prefetch task");
+        }
+    }
+
+    bool Prefetcher::queue(const char* url) {
+        char *copy;
+        bool stored;
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        stored = find(url) != NULL;
+        xSemaphoreGive(m_mutex);
+
+        if (stored) {
+            return true;
+        }
+
+        if (m_queue == NULL || (copy = strdup(url)) == NULL) {
+            return false;
+        }
+
+        if (xQueueSend(m_queue, &copy, 0) != pdTRUE) {
+            ESP_LOGW(TAG, "Prefetch queue full, dropping [%s]", url);
+            free(copy);
+            m_dropped++;
+            return false;
+        }
+
+        m_queued++;
+        return true;
+    }
+
+    bool Prefetcher::take(const char* url, Data *response) {
+        entry_t *entry;
+        bool found = false;
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        expire();
+
+        if ((entry = find(url)) != NULL) {
+            memcpy(response->data(), entry->body, entry->size);
+            response->size(entry->size);
+
+            m_hits++;
+            m_bytesServed += entry->size;
+
+            // Prefetched responses are only served once
+            remove(entry);
+            found = true;
+        }
+        xSemaphoreGive(m_mutex);
+
+        if (found) {
+            ESP_LOGI(TAG, "Serving prefetched response for [%s]", url);
+        }
+        return found;
+    }
+
+    void Prefetcher::task(void* prefetcher) {
+        ((Prefetcher*) prefetcher)->run();
+    }
+
+    void Prefetcher::run(void) {
+        char *url;
+        uint8_t *body;
+        uint32_t size;
+        bool interrupted;
+
+        while (true) {
+            if (xQueueReceive(m_queue, &url, portMAX_DELAY) != pdTRUE) {
+                continue;
+            }
+
+            backOff();
+
+            if (connection->ready() && fetch(url, &body, &size, &interrupted)) {
+                store(url, body, size);
+                m_fetched++;
+                m_bytesFetched += size;
+            }
+            else if (interrupted) {
+                // Fetched again once the foreground request is done
+                m_interrupted++;
+
+                if (xQueueSendToFront(m_queue, &url, 0) == pdTRUE) {
+                    continue;
+                }
+                m_dropped++;
+            }
+            else {
+                m_failed++;
+            }
+            free(url);
+        }
+    }
+
+    void Prefetcher::enterForeground(void) {
+        portENTER_CRITICAL(&m_lock);
+        m_foreground++;
+        portEXIT_CRITICAL(&m_lock);
+    }
+
+    void Prefetcher::leaveForeground(void) {
+        portENTER_CRITICAL(&m_lock);
+        m_foreground--;
+        m_timeForeground = millis();
+        portEXIT_CRITICAL(&m_lock);
+    }
+
+    bool Prefetcher::inForeground(void) {
+        return m_foreground > 0 || millis() - m_timeForeground < WIC64_PREFETCH_BACKOFF;
+    }
+
+    void Prefetcher::backOff(void) {
+        bool paused = false;
+
+        while (inForeground()) {
+            paused = true;
+            vTaskDelay(pdMS_TO_TICKS(WIC64_PREFETCH_BACKOFF / 5));
+        }
+        if (paused) m_pauses++;
+    }
+
+    bool Prefetcher::fetch(const char* url, uint8_t **body, uint32_t *size, bool *interrupted) {
+        esp_http_client_handle_t client;
+        char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+        IPAddress address;
+        int32_t content_length;
+        int32_t bytes_read = 0;
+        uint32_t capacity;
+        uint8_t *data = NULL;
+        bool success = false;
+
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+        esp_http_client_config_t config = {
+            .url = url,
+            .method = HTTP_METHOD_GET,
+            .timeout_ms = (int) WIC64_DEFAULT_REMOTE_TIMEOUT,
+            .disable_auto_redirect = false,
+            .max_redirection_count = 10,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+        };
+
+        #pragma GCC diagnostic pop
+
+        ESP_LOGD(TAG, "Prefetching [%s]", url);
+        *size = 0;
+        *interrupted = false;
+
+        if (Resolver::host(url, host, sizeof(host))) {
+            resolver->resolve(host, address);
+        }
+
+        if ((client = esp_http_client_init(&config)) == NULL) {
+            ESP_LOGE(TAG, "Failed to create esp_http_client");
+            return false;
+        }
+        esp_http_client_set_header(client, "User-Agent", "WiC64/" WIC64_VERSION_SHORT_STRING " (ESP32)");
+
+        if (esp_http_client_open(client, 0) != ESP_OK ||
+            (content_length = esp_http_client_fetch_headers(client)) < 0 ||
+            esp_http_client_get_status_code(client) != 200 ||
+            content_length > WIC64_PREFETCH_MAX_ENTRY_SIZE) {
+            ESP_LOGW(TAG, "Failed to prefetch [%s]", url);
+            goto DONE;
+        }
+
+        capacity = content_length > 0 ? content_length : WIC64_PREFETCH_MAX_ENTRY_SIZE;
+
+        if ((data = (uint8_t*) malloc(capacity + 1)) == NULL) {
+            goto DONE;
+        }
+
+        // Read in small pieces and give up the connection as
+        // soon as a foreground request comes in
+        while (*size <= capacity) {
+            if (inForeground()) {
+                ESP_LOGD(TAG, "Foreground request, aborting prefetch of [%s]", url);
+                *interrupted = true;
+                free(data);
+                goto DONE;
+            }
+
+            if ((bytes_read = esp_http_client_read(client, (char*) data + *size,
+                MIN(capacity + 1 - *size, WIC64_QUEUE_SEGMENT_SIZE))) <= 0) {
+                break;
+            }
+            *size += bytes_read;
+        }
+
+        if (bytes_read < 0 || *size > capacity) {
+            ESP_LOGW(TAG, "Failed to read response for [%s]", url);
+            free(data);
+            goto DONE;
+        }
+
+        *body = data;
+        success = true;
+
+    DONE:
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        return success;
+    }
+
+    void Prefetcher::store(const char* url, uint8_t *body, uint32_t size) {
+        entry_t *entry = NULL;
+        entry_t *oldest;
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        expire();
+
+        if ((entry = find(url)) != NULL) {
+            remove(entry);
+        }
+
+        while (true) {
+            entry = NULL;
+            oldest = NULL;
+
+            for (uint8_t i=0; i<WIC64_PREFETCH_ENTRIES; i++) {
+                if (m_entries[i].body == NULL) {
+                    if (entry == NULL) entry = &m_entries[i];
+                }
+                else if (oldest == NULL || m_entries[i].timeStored < oldest->timeStored) {
+                    oldest = &m_entries[i];
+                }
+            }
+
+            if (entry != NULL && m_memory + size <= WIC64_PREFETCH_MEMORY) {
+                break;
+            }
+
+            // Make room by dropping the oldest response, which has not been used
+            m_wasted++;
+            remove(oldest);
+        }
+
+        entry->url = url;
+        entry->body = body;
+        entry->size = size;
+        entry->timeStored = millis();
+        m_memory += size;
+
+        xSemaphoreGive(m_mutex);
+
+        ESP_LOGI(TAG, "Prefetched %d bytes from [%s]", size, url);
+    }
+
+    Prefetcher::entry_t* Prefetcher::find(const char* url) {
+        for (uint8_t i=0; i<WIC64_PREFETCH_ENTRIES; i++) {
+            if (m_entries[i].body != NULL && m_entries[i].url == url) {
+                return &m_entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    void Prefetcher::remove(entry_t *entry) {
+        free(entry->body);
+        m_memory -= entry->size;
+
+        entry->url = "";
+        entry->body = NULL;
+        entry->size = 0;
+    }
+
+    void Prefetcher::expire(void) {
+        for (uint8_t i=0; i<WIC64_PREFETCH_ENTRIES; i++) {
+            if (m_entries[i].body != NULL && millis() - m_entries[i].timeStored > WIC64_PREFETCH_TTL) {
+                m_wasted++;
+                remove(&m_entries[i]);
+            }
+        }
+    }
+
+    String Prefetcher::statistics(void) {
+        char statistics[320];
+        uint32_t used;
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        expire();
+        used = m_memory;
+        xSemaphoreGive(m_mutex);
+
+        snprintf(statistics, sizeof(statistics),
+            "Prefetch: %d queued, %d dropped, %d fetched, %d failed, %d paused and %d aborted for foreground requests\n"
+            "Prefetch store: %d of %d bytes used, %d hits, %d unused, %d%% useful, "
+            "%llu bytes fetched, %llu bytes served",
+            m_queued,
+            m_dropped,
+            m_fetched,
+            m_failed,
+            m_pauses,
+            m_interrupted,
+            used,
+            WIC64_PREFETCH_MEMORY,
+            m_hits,
+            m_wasted,
+            m_fetched ? m_hits * 100 / m_fetched : 0,
+            m_bytesFetched,
+            m_bytesServed);
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef WIC64_PREFETCHER_H
+#define WIC64_PREFETCHER_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp32-hal.h"
+#include "WString.h"
+
+#include "data.h"
+
+#define WIC64_PREFETCH_MEMORY 0x8000
+#define WIC64_PREFETCH_ENTRIES 8
+#define WIC64_PREFETCH_QUEUE_SIZE 16
+#define WIC64_PREFETCH_PRIORITY 1
+
+// Prefetched responses are served once within this time, regardless
+// of their cache headers, they are dropped unused afterwards
+#define WIC64_PREFETCH_TTL 60000 // ms
+
+// The prefetch task pauses while a foreground request is handled and
+// for this long afterwards, so that it never competes with it
+#define WIC64_PREFETCH_BACKOFF 250 // ms
+
+namespace WiC64 {
+
+    /* Fetches URLs requested by the C64 in the background, while the
+     * C64 is busy with something else, and keeps the responses in RAM
+     * until they are requested by a regular HTTP GET request.
+     *
+     * URLs are fetched one at a time by a task with the lowest priority
+     * above idle. The task also backs off while Service is handling a
+     * foreground request, see enterForeground(). A prefetch that is
+     * still reading when a foreground request comes in is aborted and
+     * queued again.
+     */
+    class Prefetcher {
+        public:
+            static const char* TAG;
+
+        private:
+            typedef struct {
+                String url;
+                uint8_t *body;
+                uint32_t size;
+                uint32_t timeStored;
+            } entry_t;
+
+            entry_t m_entries[WIC64_PREFETCH_ENTRIES];
+            uint32_t m_memory = 0;
+
+            QueueHandle_t m_queue = NULL;
+            SemaphoreHandle_t m_mutex = NULL;
+            TaskHandle_t m_task = NULL;
+
+            portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+            volatile uint8_t m_foreground = 0;
+            volatile uint32_t m_timeForeground = 0;
+
+            uint32_t m_queued = 0;
+            uint32_t m_dropped = 0;
+            uint32_t m_fetched = 0;
+            uint32_t m_failed = 0;
+            uint32_t m_hits = 0;
+            uint32_t m_wasted = 0;
+            uint32_t m_pauses = 0;
+            uint32_t m_interrupted = 0;
+            uint64_t m_bytesFetched = 0;
+            uint64_t m_bytesServed = 0;
+
+            static void task(void* prefetcher);
+            void run(void);
+            void backOff(void);
+            bool inForeground(void);
+
+            bool fetch(const char* url, uint8_t **body, uint32_t *size, bool *interrupted);
+            void store(const char* url, uint8_t *body, uint32_t size);
+
+            entry_t* find(const char* url);
+            void remove(entry_t *entry);
+            void expire(void);
+
+        public:
+            Prefetcher();
+
+            bool queue(const char* url);
+            bool take(const char* url, Data *response);
+            void enterForeground(void);
+            void leaveForeground(void);
+
+            String statistics(void);
+    };
+
+    extern Prefetcher *prefetcher;
+}
+
+#endif // WIC64_PREFETCHER_H
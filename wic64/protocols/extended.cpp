@@ -7,19 +7,30 @@ namespace WiC64 {
     Request *Extended::createRequest(uint8_t *header) {
         uint8_t command_id = header[0];
         uint32_t payload_size = (*((uint32_t*) (header+1))) ;
+        bool compress_response = header[4] & COMPRESS_RESPONSE;
+        bool framed_response = header[4] & FRAMED_RESPONSE;
+        Request *request;
+
+        payload_size &= ~((uint32_t) (COMPRESS_RESPONSE | FRAMED_RESPONSE) << 24);
 
         ESP_LOGI(TAG, "Received %s request header "
                       WIC64_CYAN("[") WIC64_FORMAT_CMD WIC64_CYAN(" 0x%02x 0x%02x 0x%02x 0x%02x] ")
-                      WIC64_GREEN("(payload %d bytes)"),
+                      WIC64_GREEN("(payload %d bytes%s%s)"),
             this->name(),
             command_id,
             header[1],
             header[2],
             header[3],
             header[4],
-            payload_size);
+            payload_size,
+            compress_response ? ", compressed response" : "",
+            framed_response ? ", framed response" : "");
+
+        request = new Request(this, command_id, payload_size);
+        request->compressResponse(compress_response);
+        request->framedResponse(framed_response);
 
-        return new Request(this, command_id, payload_size);
+        return request;
     }
 
     void Extended::setResponseHeader(uint8_t *header, uint8_t status, uint32_t size) {
@@ -10,6 +10,18 @@ namespace WiC64 {
             using Protocol::Protocol;
             static const char *TAG;
 
+            // Set in the highest byte of the request payload size to
+            // ask for an Lz compressed response, see lz.h
+            static const uint8_t COMPRESS_RESPONSE = 0x80;
+
+            // Set in the highest byte of the request payload size if the
+            // client accepts a framed response of unknown length, see
+            // WIC64_FRAMED_RESPONSE_SIZE
+            static const uint8_t FRAMED_RESPONSE = 0x40;
+
+            // Set in the response status if the response is compressed
+            static const uint8_t COMPRESSED = 0x80;
+
             Request *createRequest(uint8_t *header);
             void setResponseHeader(uint8_t *header, uint8_t status, uint32_t size);
     };
@@ -5,17 +5,21 @@
 
 #include "protocol.h"
 #include "data.h"
+#include "arena.h"
 
 namespace WiC64 {
     class Protocol;
 
     class Request {
         public: static const char* TAG;
+            WIC64_ARENA_ALLOCATED
 
         private:
             Protocol* m_protocol = nullptr;
             uint8_t m_id = 0x00;
             Data* m_payload = new Data();
+            bool m_compressResponse = false;
+            bool m_framedResponse = false;
 
         public:
             Request(Protocol *protocol, uint8_t id, uint32_t payload_size)
@@ -31,6 +35,12 @@ namespace WiC64 {
 
             Data* payload(void) { return m_payload; }
             Data* payload(uint8_t *data, uint32_t size);
+
+            bool compressResponse(void) { return m_compressResponse; }
+            void compressResponse(bool compressResponse) { m_compressResponse = compressResponse; }
+
+            bool framedResponse(void) { return m_framedResponse; }
+            void framedResponse(bool framedResponse) { m_framedResponse = framedResponse; }
     };
 }
 
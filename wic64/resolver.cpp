@@ -0,0 +1,240 @@
+#include <cstring>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "WiFi.h"
+
+#include "resolver.h"
+
+namespace WiC64 {
+    const char* Resolver::TAG = "RESOLVER";
+
+    Resolver::Resolver() {
+        memset(m_entries, 0, sizeof(m_entries));
+
+        if ((m_mutex = xSemaphoreCreateMutex()) == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create resolver mutex");
+            return;
+        }
+
+        xTaskCreatePinnedToCore(task, "RESOLVER", 4096, this, 5, &m_task, 0);
+
+        if (m_task == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create resolver task");
+        }
+    }
+
+    bool Resolver::host(const char* url, char* host, size_t size) {
+        const char *start, *end, *at;
+        size_t length;
+
+        // Extract the host from "[<scheme>://][<user>@]<host>[:<port>][/...]"
+        start = (start = strstr(url, "://")) != NULL ? start + 3 : url;
+        end = start + strcspn(start, ":/?#");
+
+        if ((at = (const char*) memchr(start, '@', strcspn(start, "/?#"))) != NULL) {
+            start = at + 1;
+            end = start + strcspn(start, ":/?#");
+        }
+
+        if ((length = end - start) == 0 || length >= size) {
+            return false;
+        }
+
+        strncpy(host, start, length);
+        host[length] = '\0';
+        return true;
+    }
+
+    Resolver::entry_t* Resolver::find(const char* host) {
+        for (uint8_t i=0; i<WIC64_RESOLVER_ENTRIES; i++) {
+            if (m_entries[i].host[0] != '\0' && strcasecmp(m_entries[i].host, host) == 0) {
+                return &m_entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    Resolver::entry_t* Resolver::allocate(const char* host) {
+        entry_t *entry = NULL;
+
+        // Take a free entry or replace the least recently used one
+        for (uint8_t i=0; i<WIC64_RESOLVER_ENTRIES; i++) {
+            if (m_entries[i].host[0] == '\0') {
+                entry = &m_entries[i];
+                break;
+            }
+            if (entry == NULL || m_entries[i].timeUsed < entry->timeUsed) {
+                entry = &m_entries[i];
+            }
+        }
+
+        strncpy(entry->host, host, WIC64_RESOLVER_MAX_HOST_LENGTH);
+        entry->host[WIC64_RESOLVER_MAX_HOST_LENGTH] = '\0';
+        entry->resolved = false;
+        entry->timeUsed = millis();
+
+        return entry;
+    }
+
+    bool Resolver::lookup(const char* host, IPAddress& address) {
+        int64_t start = esp_timer_get_time();
+        uint32_t elapsed;
+        bool success;
+
+        success = WiFi.hostByName(host, address) == 1;
+        elapsed = esp_timer_get_time() - start;
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        m_lookups++;
+        m_lookupTime += elapsed;
+        if (elapsed > m_maxLookupTime) m_maxLookupTime = elapsed;
+        if (!success) m_failures++;
+        xSemaphoreGive(m_mutex);
+
+        ESP_LOG_LEVEL(success ? ESP_LOG_DEBUG : ESP_LOG_WARN, TAG,
+            "%s %s in %dms",
+            success ? "Resolved" : "Failed to resolve",
+            host,
+            elapsed / 1000);
+
+        return success;
+    }
+
+    bool Resolver::resolve(const char* host, IPAddress& address) {
+        entry_t *entry;
+
+        // Nothing to resolve for numeric addresses
+        if (address.fromString(host)) {
+            return true;
+        }
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        if ((entry = find(host)) != NULL) {
+            entry->timeUsed = millis();
+
+            if (entry->resolved && millis() - entry->timeResolved < WIC64_RESOLVER_TTL) {
+                address = entry->address;
+                m_hits++;
+                xSemaphoreGive(m_mutex);
+
+                ESP_LOGV(TAG, "Cache hit for %s", host);
+                return true;
+            }
+        }
+        m_misses++;
+        xSemaphoreGive(m_mutex);
+
+        ESP_LOGV(TAG, "Cache miss for %s", host);
+
+        if (!lookup(host, address)) {
+            return false;
+        }
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        if ((entry = find(host)) == NULL) {
+            entry = allocate(host);
+        }
+        entry->address = address;
+        entry->resolved = true;
+        entry->timeResolved = millis();
+
+        xSemaphoreGive(m_mutex);
+        return true;
+    }
+
+    void Resolver::prefetch(const char* host) {
+        IPAddress address;
+
+        if (address.fromString(host)) {
+            return;
+        }
+
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        if (find(host) == NULL) {
+            ESP_LOGD(TAG, "Prefetching %s", host);
+            allocate(host);
+        }
+        xSemaphoreGive(m_mutex);
+
+        // Wake up the resolver task to resolve the new entry right away
+        xTaskNotifyGive(m_task);
+    }
+
+    void Resolver::flush(void) {
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        for (uint8_t i=0; i<WIC64_RESOLVER_ENTRIES; i++) {
+            m_entries[i].resolved = false;
+        }
+        xSemaphoreGive(m_mutex);
+    }
+
+    void Resolver::task(void* resolver) {
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(WIC64_RESOLVER_REFRESH_INTERVAL));
+
+            if (WiFi.isConnected()) {
+                ((Resolver*) resolver)->refresh();
+            }
+        }
+    }
+
+    void Resolver::refresh(void) {
+        char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+        IPAddress address;
+        entry_t *entry;
+        uint32_t now;
+
+        for (uint8_t i=0; i<WIC64_RESOLVER_ENTRIES; i++) {
+            xSemaphoreTake(m_mutex, portMAX_DELAY);
+            entry = &m_entries[i];
+            now = millis();
+
+            // Resolve unresolved entries and hot entries about to expire
+            if (entry->host[0] == '\0' ||
+                now - entry->timeUsed > WIC64_RESOLVER_HOT_TIME ||
+                (entry->resolved &&
+                 now - entry->timeResolved < WIC64_RESOLVER_TTL - WIC64_RESOLVER_REFRESH_AHEAD)) {
+
+                xSemaphoreGive(m_mutex);
+                continue;
+            }
+            strcpy(host, entry->host);
+            xSemaphoreGive(m_mutex);
+
+            // Don't hold the mutex during the lookup
+            if (!lookup(host, address)) {
+                continue;
+            }
+
+            xSemaphoreTake(m_mutex, portMAX_DELAY);
+            if (strcmp(entry->host, host) == 0) {
+                entry->address = address;
+                entry->resolved = true;
+                entry->timeResolved = millis();
+                m_refreshes++;
+            }
+            xSemaphoreGive(m_mutex);
+        }
+    }
+
+    String Resolver::statistics(void) {
+        char statistics[200];
+
+        snprintf(statistics, sizeof(statistics),
+            "DNS cache: %d hits, %d misses, %d background refreshes, "
+            "%d lookups, %d failed, avg %lldms, max %dms",
+            m_hits,
+            m_misses,
+            m_refreshes,
+            m_lookups,
+            m_failures,
+            m_lookups ? m_lookupTime / m_lookups / 1000 : 0,
+            m_maxLookupTime / 1000);
+
+        return String(statistics);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef WIC64_RESOLVER_H
+#define WIC64_RESOLVER_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "IPAddress.h"
+#include "WString.h"
+
+#define WIC64_RESOLVER_ENTRIES 8
+#define WIC64_RESOLVER_MAX_HOST_LENGTH 63
+
+// lwIP does not pass the TTL of a DNS answer on to the caller,
+// so cached addresses expire after a fixed time instead
+#define WIC64_RESOLVER_TTL 120000 // ms
+
+// Entries used within WIC64_RESOLVER_HOT_TIME are resolved again
+// WIC64_RESOLVER_REFRESH_AHEAD before they would expire
+#define WIC64_RESOLVER_HOT_TIME 600000 // ms
+#define WIC64_RESOLVER_REFRESH_AHEAD 20000 // ms
+#define WIC64_RESOLVER_REFRESH_INTERVAL 5000 // ms
+
+namespace WiC64 {
+
+    /* Small in-memory DNS cache in front of lwIP.
+     *
+     * TcpClient connects to cached addresses directly. esp_http_client
+     * always does its own lookup, so for HTTP the resolver keeps the
+     * lwIP DNS table warm instead: hot entries are resolved again in
+     * the background before they expire, so the lookup done by
+     * esp_http_client is answered from the table.
+     */
+    class Resolver {
+        public:
+            static const char* TAG;
+
+        private:
+            typedef struct {
+                char host[WIC64_RESOLVER_MAX_HOST_LENGTH+1];
+                IPAddress address;
+                bool resolved;
+                uint32_t timeResolved;
+                uint32_t timeUsed;
+            } entry_t;
+
+            entry_t m_entries[WIC64_RESOLVER_ENTRIES];
+            SemaphoreHandle_t m_mutex = NULL;
+            TaskHandle_t m_task = NULL;
+
+            uint32_t m_hits = 0;
+            uint32_t m_misses = 0;
+            uint32_t m_refreshes = 0;
+            uint32_t m_failures = 0;
+            uint32_t m_lookups = 0;
+            int64_t m_lookupTime = 0; // us
+            uint32_t m_maxLookupTime = 0; // us
+
+            static void task(void* resolver);
+            void refresh(void);
+
+            bool lookup(const char* host, IPAddress& address);
+            entry_t* find(const char* host);
+            entry_t* allocate(const char* host);
+
+        public:
+            Resolver();
+
+            static bool host(const char* url, char* host, size_t size);
+
+            bool resolve(const char* host, IPAddress& address);
+            void prefetch(const char* host);
+            void flush(void);
+
+            String statistics(void);
+    };
+
+    extern Resolver *resolver;
+}
+
+#endif // WIC64_RESOLVER_H
@@ -0,0 +1,315 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ring.h"
+#include "utilities.h"
+
+#define WIC64_RING_BENCHMARK_BYTES (256 * 1024)
+#define WIC64_RING_BENCHMARK_SEGMENT_SIZE 0x1000
+#define WIC64_RING_BENCHMARK_SIZE (4 * WIC64_RING_BENCHMARK_SEGMENT_SIZE)
+
+// reserve() and acquire() take their timeout in ms, so portMAX_DELAY
+// (in ticks) can't be used to wait forever here
+#define WIC64_RING_BENCHMARK_TIMEOUT 1000 // ms
+
+namespace WiC64 {
+    const char* Ring::TAG = "RING";
+
+    Ring::Ring(uint8_t *buffer, uint32_t size) {
+        if (size & (size - 1)) {
+            ESP_LOGE(TAG, "Ring size %d is not a power of two", size);
+        }
+        m_buffer = buffer;
+        m_size = size;
+
+        m_readable = xSemaphoreCreateBinary();
+        m_writable = xSemaphoreCreateBinary();
+        m_detached = xSemaphoreCreateBinary();
+
+        if (m_readable == NULL || m_writable == NULL || m_detached == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create ring semaphores");
+        }
+    }
+
+    Ring::~Ring() {
+        vSemaphoreDelete(m_readable);
+        vSemaphoreDelete(m_writable);
+        vSemaphoreDelete(m_detached);
+    }
+
+    bool Ring::wait(SemaphoreHandle_t semaphore, TickType_t start, uint32_t timeout_ms) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+
+        if (elapsed >= timeout) {
+            return false;
+        }
+        xSemaphoreTake(semaphore, timeout - elapsed);
+        return true;
+    }
+
+    uint32_t Ring::reserve(uint8_t **data, uint32_t max, uint32_t timeout_ms) {
+        TickType_t start = xTaskGetTickCount();
+        uint32_t free, offset;
+
+        while ((free = space()) == 0 || m_resetPending) {
+            // Producers of an aborted transfer get no more space
+            if (m_resetPending || !wait(m_writable, start, timeout_ms)) {
+                return 0;
+            }
+        }
+
+        // Only hand out space up to the end of the buffer,
+        // the remaining space is reserved by the next call
+        offset = m_head & (m_size - 1);
+        *data = m_buffer + offset;
+
+        return MIN(MIN(free, m_size - offset), max);
+    }
+
+    void Ring::commit(uint32_t size) {
+        // make sure the data is visible before the new head
+        __sync_synchronize();
+        m_head = m_head + size;
+        xSemaphoreGive(m_readable);
+    }
+
+    uint32_t Ring::acquire(uint8_t **data, uint32_t max, uint32_t timeout_ms) {
+        TickType_t start = xTaskGetTickCount();
+        uint32_t ready, offset;
+
+        while ((ready = available()) == 0) {
+            if (m_closed || !wait(m_readable, start, timeout_ms)) {
+                return 0;
+            }
+        }
+        __sync_synchronize();
+
+        offset = m_read & (m_size - 1);
+        *data = m_buffer + offset;
+
+        ready = MIN(MIN(ready, m_size - offset), max);
+        m_read += ready;
+
+        return ready;
+    }
+
+    void Ring::release(uint32_t size) {
+        m_tail = m_tail + size;
+        xSemaphoreGive(m_writable);
+    }
+
+    void Ring::close(void) {
+        m_closed = true;
+        xSemaphoreGive(m_readable);
+    }
+
+    void Ring::reset(void) {
+        bool attached;
+
+        portENTER_CRITICAL(&m_lock);
+        m_generation++;
+        m_stalled = false;
+
+        if ((attached = m_producers > 0)) {
+            m_resetPending = true;
+        }
+        portEXIT_CRITICAL(&m_lock);
+
+        if (attached) {
+            // Wake up producers waiting for space, they are aborted now
+            ESP_LOGD(TAG, "Deferring reset until all producers have detached");
+            xSemaphoreGive(m_writable);
+            return;
+        }
+
+        m_head = 0;
+        m_tail = 0;
+        m_read = 0;
+        m_closed = false;
+
+        xSemaphoreTake(m_readable, 0);
+        xSemaphoreTake(m_writable, 0);
+    }
+
+    bool Ring::claim(uint32_t timeout_ms) {
+        TickType_t start = xTaskGetTickCount();
+        bool attached;
+
+        while (true) {
+            portENTER_CRITICAL(&m_lock);
+            attached = m_producers > 0;
+            portEXIT_CRITICAL(&m_lock);
+
+            if (!attached) {
+                break;
+            }
+
+            if (!wait(m_detached, start, timeout_ms)) {
+                ESP_LOGW(TAG, "Producers of an aborted transfer still attached after %dms", timeout_ms);
+                return false;
+            }
+        }
+
+        if (m_resetPending) {
+            m_resetPending = false;
+            reset();
+        }
+        return true;
+    }
+
+    uint32_t Ring::attach(void) {
+        uint32_t generation;
+
+        portENTER_CRITICAL(&m_lock);
+        m_producers++;
+        generation = m_generation;
+        portEXIT_CRITICAL(&m_lock);
+
+        return generation;
+    }
+
+    void Ring::detach(void) {
+        bool last;
+
+        portENTER_CRITICAL(&m_lock);
+        last = (--m_producers == 0);
+        portEXIT_CRITICAL(&m_lock);
+
+        if (last) {
+            xSemaphoreGive(m_detached);
+        }
+    }
+
+    /* Benchmark: move the same amount of data from a producer task
+     * to the calling task, once through a FreeRTOS queue of 4kb items
+     * as previously used for queued transfers, and once through a
+     * ring. The producer fills its data in place, just like
+     * esp_http_client_read() does, the consumer reads every byte just
+     * like the userport does.
+     */
+
+    typedef struct {
+        void *channel;
+        uint8_t *buffer;
+        SemaphoreHandle_t done;
+    } benchmark_args_t;
+
+    static void queueProducer(void *ptr) {
+        benchmark_args_t *args = (benchmark_args_t*) ptr;
+
+        for (uint32_t i=0; i<WIC64_RING_BENCHMARK_BYTES; i+=WIC64_RING_BENCHMARK_SEGMENT_SIZE) {
+            memset(args->buffer, (uint8_t) i, WIC64_RING_BENCHMARK_SEGMENT_SIZE);
+            xQueueSend((QueueHandle_t) args->channel, args->buffer, portMAX_DELAY);
+        }
+        xSemaphoreGive(args->done);
+        vTaskDelete(NULL);
+    }
+
+    static void ringProducer(void *ptr) {
+        benchmark_args_t *args = (benchmark_args_t*) ptr;
+        Ring *ring = (Ring*) args->channel;
+        uint8_t *data;
+        uint32_t size;
+
+        for (uint32_t i=0; i<WIC64_RING_BENCHMARK_BYTES; i+=size) {
+            if ((size = ring->reserve(&data, WIC64_RING_BENCHMARK_BYTES - i, WIC64_RING_BENCHMARK_TIMEOUT)) == 0) {
+                break;
+            }
+            memset(data, (uint8_t) i, size);
+            ring->commit(size);
+        }
+        xSemaphoreGive(args->done);
+        vTaskDelete(NULL);
+    }
+
+    String Ring::benchmark(void) {
+        benchmark_args_t args;
+        uint8_t *producerBuffer = NULL;
+        uint8_t *consumerBuffer = NULL;
+        uint8_t *ringBuffer = NULL;
+        QueueHandle_t queue = NULL;
+        Ring *ring = NULL;
+
+        uint8_t *data;
+        uint32_t size, sum = 0;
+        int64_t start, us[2];
+        char report[256];
+
+        producerBuffer = (uint8_t*) malloc(WIC64_RING_BENCHMARK_SEGMENT_SIZE);
+        consumerBuffer = (uint8_t*) malloc(WIC64_RING_BENCHMARK_SEGMENT_SIZE);
+        ringBuffer = (uint8_t*) malloc(WIC64_RING_BENCHMARK_SIZE);
+        queue = xQueueCreate(WIC64_RING_BENCHMARK_SIZE / WIC64_RING_BENCHMARK_SEGMENT_SIZE,
+                             WIC64_RING_BENCHMARK_SEGMENT_SIZE);
+        args.done = xSemaphoreCreateBinary();
+
+        if (producerBuffer == NULL || consumerBuffer == NULL ||
+            ringBuffer == NULL || queue == NULL || args.done == NULL) {
+            snprintf(report, sizeof(report), "Not enough memory, ring benchmark skipped");
+            goto DONE;
+        }
+
+        args.channel = queue;
+        args.buffer = producerBuffer;
+
+        start = esp_timer_get_time();
+        xTaskCreatePinnedToCore(queueProducer, "PRODUCER", 4096, &args, 5, NULL, 1);
+
+        for (uint32_t i=0; i<WIC64_RING_BENCHMARK_BYTES; i+=WIC64_RING_BENCHMARK_SEGMENT_SIZE) {
+            xQueueReceive(queue, consumerBuffer, portMAX_DELAY);
+            for (uint32_t k=0; k<WIC64_RING_BENCHMARK_SEGMENT_SIZE; k++) sum += consumerBuffer[k];
+        }
+        xSemaphoreTake(args.done, portMAX_DELAY);
+        us[0] = esp_timer_get_time() - start;
+
+        ring = new Ring(ringBuffer, WIC64_RING_BENCHMARK_SIZE);
+        args.channel = ring;
+
+        start = esp_timer_get_time();
+        xTaskCreatePinnedToCore(ringProducer, "PRODUCER", 4096, &args, 5, NULL, 1);
+
+        for (uint32_t i=0; i<WIC64_RING_BENCHMARK_BYTES; i+=size) {
+            if ((size = ring->acquire(&data, WIC64_RING_BENCHMARK_SEGMENT_SIZE, WIC64_RING_BENCHMARK_TIMEOUT)) == 0) {
+                break;
+            }
+            for (uint32_t k=0; k<size; k++) sum += data[k];
+            ring->release(size);
+        }
+        // The producer gives up after WIC64_RING_BENCHMARK_TIMEOUT as well
+        xSemaphoreTake(args.done, portMAX_DELAY);
+        us[1] = esp_timer_get_time() - start;
+
+        if (size == 0) {
+            snprintf(report, sizeof(report), "Ring benchmark timed out after %lldus", us[1]);
+            goto DONE;
+        }
+
+        // Each queue item is copied into the queue and out of it again
+        snprintf(report, sizeof(report),
+            "Queued transfer of %dkb (checksum %08x):\n"
+            "  FreeRTOS queue: %dkb copied, %lldus, approx. %lldkb/s\n"
+            "  Ring:           %dkb copied, %lldus, approx. %lldkb/s",
+            WIC64_RING_BENCHMARK_BYTES / 1024, sum,
+            2 * WIC64_RING_BENCHMARK_BYTES / 1024, us[0],
+            (int64_t) WIC64_RING_BENCHMARK_BYTES * 1000000 / 1024 / MAX(us[0], 1),
+            0, us[1],
+            (int64_t) WIC64_RING_BENCHMARK_BYTES * 1000000 / 1024 / MAX(us[1], 1));
+
+    DONE:
+        if (ring != NULL) delete ring;
+        if (queue != NULL) vQueueDelete(queue);
+        if (args.done != NULL) vSemaphoreDelete(args.done);
+        free(producerBuffer);
+        free(consumerBuffer);
+        free(ringBuffer);
+
+        ESP_LOGW(TAG, "Benchmark results:\n%s", report);
+        return String(report);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef WIC64_RING_H
+#define WIC64_RING_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "WString.h"
+
+namespace WiC64 {
+
+    /* Single producer, single consumer byte ring used for queued
+     * transfers.
+     *
+     * Neither side copies data into or out of the ring: the producer
+     * reserves contiguous space, writes to it in place and commits
+     * the number of bytes actually written. The consumer acquires
+     * contiguous data, reads it in place and releases it once it is
+     * no longer needed. The consumer may hold several acquired
+     * segments at once, they are released in the same order.
+     *
+     * reserve() and acquire() block until space or data becomes
+     * available or the timeout has expired, in which case they
+     * return 0.
+     *
+     * If the amount of data is not known in advance, the producer
+     * closes the ring after the last commit. acquire() then returns
+     * 0 without waiting once all data has been acquired, and closed()
+     * tells this apart from a timeout.
+     *
+     * A producer running on a worker may outlive the transfer it was
+     * started for. It attach()es to the transfer, stops as soon as
+     * aborted() returns true and detach()es once it is done. If the
+     * ring is reset while producers are still attached, the reset is
+     * deferred until they have detached, claim() waits for this before
+     * a new transfer is started.
+     *
+     * While the producer is stalled, e.g. because it is reconnecting,
+     * the consumer should keep waiting instead of giving up.
+     */
+    class Ring {
+        public:
+            static const char* TAG;
+
+        private:
+            uint8_t *m_buffer;
+            uint32_t m_size; // power of two
+
+            volatile uint32_t m_head = 0; // bytes committed by the producer
+            volatile uint32_t m_tail = 0; // bytes released by the consumer
+            uint32_t m_read = 0;          // bytes acquired by the consumer
+            volatile bool m_closed = false;
+            volatile bool m_stalled = false;
+
+            portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+            volatile uint32_t m_generation = 0;
+            uint8_t m_producers = 0;
+            volatile bool m_resetPending = false;
+
+            SemaphoreHandle_t m_readable;
+            SemaphoreHandle_t m_writable;
+            SemaphoreHandle_t m_detached;
+
+            static bool wait(SemaphoreHandle_t semaphore, TickType_t start, uint32_t timeout_ms);
+
+        public:
+            Ring(uint8_t *buffer, uint32_t size);
+            ~Ring();
+
+            uint32_t size(void) { return m_size; }
+            uint32_t available(void) { return m_head - m_read; }
+            uint32_t space(void) { return m_size - (m_head - m_tail); }
+
+            uint32_t reserve(uint8_t **data, uint32_t max, uint32_t timeout_ms);
+            void commit(uint32_t size);
+
+            uint32_t acquire(uint8_t **data, uint32_t max, uint32_t timeout_ms);
+            void release(uint32_t size);
+
+            void close(void);
+            bool closed(void) { return m_closed && available() == 0; }
+
+            void reset(void);
+            bool claim(uint32_t timeout_ms);
+
+            uint32_t attach(void);
+            void detach(void);
+            bool aborted(uint32_t generation) { return generation != m_generation; }
+
+            void stalled(bool stalled) { m_stalled = stalled; }
+            bool stalled(void) { return m_stalled; }
+
+            static String benchmark(void);
+    };
+}
+
+#endif // WIC64_RING_H
@@ -1,8 +1,8 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 
 #include "esp32-hal.h"
-#include "esp_event.h"
 
 #include "wic64.h"
 #include "service.h"
@@ -12,8 +12,11 @@
 #include "command.h"
 #include "display.h"
 #include "utilities.h"
-
-ESP_EVENT_DEFINE_BASE(SERVICE_EVENTS);
+#include "arena.h"
+#include "lz.h"
+#include "flashCache.h"
+#include "prefetcher.h"
+#include "protocols/extended.h"
 
 namespace WiC64 {
     const char* Service::TAG = "SERVICE";
@@ -23,22 +26,10 @@ namespace WiC64 {
     extern Display *display;
 
     Service::Service() {
-        esp_event_loop_args_t event_loop_args = {
-            .queue_size = 16,
-            .task_name = TAG,
-            .task_priority = 15,
-            .task_stack_size = 8192,
-            .task_core_id = 1
-        };
-
-        esp_event_loop_create(&event_loop_args, &event_loop_handle);
-
-        esp_event_handler_register_with(
-            event_loop_handle,
-            SERVICE_EVENTS,
-            SERVICE_RESPONSE_READY,
-            onResponseReady,
-            NULL);
+        m_dispatcher = new Dispatcher(TAG, 15, 8192, 1);
+        m_dispatcher->on(SERVICE_RESPONSE_READY, onResponseReady);
+        m_dispatcher->on(SERVICE_PAYLOAD_PENDING, onPayloadPending);
+        m_dispatcher->on(SERVICE_TURNAROUND_PENDING, onTurnaroundPending);
 
         ESP_LOGI(TAG, "Command service initialized");
     }
@@ -48,7 +39,6 @@ namespace WiC64 {
     }
 
     void Service::receiveRequestHeader(Protocol *protocol) {
-        static uint8_t header[Protocol::MAX_REQUEST_HEADER_SIZE];
         this->protocol = protocol;
 
         if (command != NULL) {
@@ -59,21 +49,38 @@ namespace WiC64 {
             return;
         }
 
-        userport->receivePartial(header, protocol->requestHeaderSize(), onRequestHeaderReceived, onRequestHeaderAborted);
+        // The header and a static payload are received as a single
+        // transfer, onRequestHeaderReceived() decides on the payload
+        userport->receive(request_header, protocol->requestHeaderSize(),
+            onRequestHeaderReceived, onRequestTransferred, onRequestHeaderAborted);
     }
 
     void Service::onRequestHeaderAborted(uint8_t *header, uint32_t bytes_received) {
+        uint32_t header_size = service->protocol->requestHeaderSize();
+
+        if (service->command != NULL) {
+            onRequestAborted(NULL, bytes_received > header_size ? bytes_received - header_size : 0);
+            return;
+        }
         ESP_LOGE(TAG, "Failed to receive request header");
         ESP_LOGW(TAG, "Received %d of %d bytes",
             bytes_received, service->protocol->requestHeaderSize());
     }
 
-    void Service::onRequestHeaderReceived(uint8_t *header, uint32_t size) {
+    bool Service::onRequestHeaderReceived(uint8_t **payload_data, uint32_t *payload_size) {
         ESP_LOGD(TAG, "Parsing %s request header...", service->protocol->name());
 
-        service->request = service->protocol->createRequest(header);
+        // No payload will be received unless it is static
+        *payload_data = NULL;
+        *payload_size = 0;
+
+        service->request = service->protocol->createRequest(service->request_header);
         service->command = Command::create(service->request);
 
+        // Keeps the prefetch task out of the way of every command until
+        // the request is finalized, including queued responses
+        prefetcher->enterForeground();
+
         if (customTransferTimeout) {
             transferTimeout = customTransferTimeout;
             customTransferTimeout = 0;
@@ -102,19 +109,22 @@ namespace WiC64 {
                 service->protocol->id());
 
             service->finalizeRequest("Command not supported by protocol", false);
-            return;
+            return true;
         }
 
         if (!service->request->hasPayload()) {
-            service->onRequestReceived();
-            return;
+            return true;
         }
 
+        // Give the command a chance to do some work while the payload is being received
+        service->command->prepare();
+
         ESP_LOGI(TAG, "Receiving request payload");
         Data* payload = service->request->payload();
 
         if (payload->size() < 0x10000) {
-            service->receiveStaticRequest();
+            *payload_data = payload->data();
+            *payload_size = payload->size();
         }
         else {
             if(!service->command->supportsQueuedRequest()) {
@@ -123,14 +133,51 @@ namespace WiC64 {
                     service->command->describe());
 
                 service->finalizeRequest("Command does not support sending payloads >=64kb", false);
-                return;
+                return true;
             }
-            ESP_LOGI(TAG, "Starting queued receive of %d bytes", payload->size());
 
+            // Producers of an aborted response may still be attached.
+            // This runs on the userport dispatcher, which must not wait
+            // for them, onRequestTransferred() hands the wait over.
+            service->queue_claimed = transferQueue->claim(0);
             payload->queue(transferQueue, payload->size());
+        }
+        return true;
+    }
+
+    void Service::onRequestTransferred(uint8_t *ignoredData, uint32_t ignoredSize) {
+        if (service->command == NULL) {
+            // Request has been rejected after parsing the header
+            return;
+        }
+
+        if (service->request->hasPayload() && service->request->payload()->isQueued()) {
+            if (!service->queue_claimed) {
+                ESP_LOGD(TAG, "Waiting for the transfer queue on the service task");
+                service->m_dispatcher->post(SERVICE_PAYLOAD_PENDING);
+                return;
+            }
+            ESP_LOGI(TAG, "Starting queued receive of %d bytes", service->request->payload()->size());
             service->receiveQueuedRequest();
-            service->onRequestReceived();
         }
+        service->onRequestReceived();
+    }
+
+    void Service::onPayloadPending(void) {
+        if (service->command == NULL) {
+            return;
+        }
+
+        if (!transferQueue->claim(transferTimeout)) {
+            service->finalizeRequest("Transfer queue still in use", false);
+            return;
+        }
+        service->queue_claimed = true;
+        service->onRequestTransferred(NULL, 0);
+    }
+
+    void Service::onTurnaroundPending(void) {
+        userport->completeTurnaround();
     }
 
     void Service::queueTask(void *payload_size_ptr) {
@@ -144,39 +191,42 @@ namespace WiC64 {
         ESP_LOGD(TAG, "Preparing queued receive of %d bytes", payload->size());
 
         bytes_remaining = payload->size();
-        items_remaining = WIC64_QUEUE_ITEMS_REQUIRED(payload->size());
 
         service->receiveQueuedRequestData();
     }
 
     void Service::receiveQueuedRequestData(uint8_t *data, uint32_t bytes_received) {
-        ESP_LOGV(TAG, "%s call of receiveQueuedRequestData(), %d bytes in %d item%s remaining",
+        Ring *queue = service->request->payload()->queue();
+        uint8_t *space;
+        uint32_t size;
+
+        ESP_LOGV(TAG, "%s call of receiveQueuedRequestData(), %d bytes remaining",
             (data == NULL) ? "First" : "Subsequent",
-            service->bytes_remaining,
-            service->items_remaining,
-            (service->items_remaining > 1) ? "s" : "");
+            service->bytes_remaining);
 
         if (data != NULL) {
-            if (xQueueSend(transferQueue, data, pdMS_TO_TICKS(transferTimeout)) != pdTRUE) {
-                ESP_LOGW(TAG, "Could not send next item to receive queue in %dms", transferTimeout);
-                onRequestAborted(NULL, service->bytes_remaining);
-            };
+            // The data has been received in place, hand it to the consumer
+            queue->commit(bytes_received);
             service->bytes_remaining -= bytes_received;
-            service->items_remaining--;
+
+            if (service->bytes_remaining == 0) {
+                return;
+            }
         }
 
-        uint32_t size = (service->items_remaining > 1)
-            ? WIC64_QUEUE_ITEM_SIZE
-            : service->bytes_remaining;
+        size = queue->reserve(&space,
+            MIN(service->bytes_remaining, WIC64_QUEUE_SEGMENT_SIZE),
+            transferTimeout);
 
-        (service->items_remaining > 1)
-            ? userport->receivePartial(transferQueueSendBuffer, size, receiveQueuedRequestData, onRequestAborted)
-            : userport->receive(transferQueueSendBuffer, size, receiveQueuedRequestData, onRequestAborted);
-    }
+        if (size == 0) {
+            ESP_LOGW(TAG, "No space left in receive queue for %dms", transferTimeout);
+            onRequestAborted(NULL, service->request->payload()->size() - service->bytes_remaining);
+            return;
+        }
 
-    void Service::receiveStaticRequest(void) {
-        Data* payload = service->request->payload();
-        userport->receive(payload->data(), payload->size(), onRequestReceived, onRequestAborted);
+        ((int32_t) size < service->bytes_remaining)
+            ? userport->receivePartial(space, size, receiveQueuedRequestData, onRequestAborted)
+            : userport->receive(space, size, receiveQueuedRequestData, onRequestAborted);
     }
 
     void Service::onRequestAborted(uint8_t *data, uint32_t bytes_received) {
@@ -208,7 +258,7 @@ namespace WiC64 {
         Command::execute(service->command);
     }
 
-    void Service::onResponseReady(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    void Service::onResponseReady(void) {
         service->sendResponse();
     }
 
@@ -216,15 +266,52 @@ namespace WiC64 {
         sendResponseHeader();
     }
 
+    void Service::compressResponse(void) {
+        Data *compressed = new Data();
+        uint32_t size;
+        int64_t start = esp_timer_get_time();
+
+        // Only send the compressed response if it is actually smaller
+        if (compressed->data() == NULL ||
+            (size = Lz::compress(response->data(), response->size(), compressed->data(), response->size() - 1)) == 0) {
+            ESP_LOGD(TAG, "Not compressing response of %d bytes", response->size());
+            delete compressed;
+            return;
+        }
+        compressed->size(size);
+
+        ESP_LOGI(TAG, "Compressed response from %d to %d bytes in %lldus",
+            response->size(), size, esp_timer_get_time() - start);
+
+        // The response now shares the buffer holding the compressed data
+        response->set(compressed);
+        response_compressed = true;
+        delete compressed;
+    }
+
     void Service::sendResponseHeader() {
-        static uint8_t header[Protocol::MAX_REQUEST_HEADER_SIZE];
         response = command->response();
+        response_compressed = false;
 
-        protocol->setResponseHeader(header, command->status(), response->sizeToReport());
+        if (request->compressResponse() && !response->isEmpty() && !response->isQueued()) {
+            compressResponse();
+        }
 
-        response->isPresent()
-            ? userport->sendPartial(header, protocol->responseHeaderSize(), onResponseHeaderSent, onResponseHeaderAborted)
-            : userport->send(header, protocol->responseHeaderSize(), onResponseHeaderSent, onResponseHeaderAborted);
+        protocol->setResponseHeader(response_header,
+            command->status() | (response_compressed ? Extended::COMPRESSED : 0),
+            response->sizeToReport());
+
+        // The header is sent together with the response data as a
+        // single transfer, unless there is no data to be sent
+        if (response->isEmpty() || (response->isQueued() && !command->canStreamResponse(response->size()))) {
+            userport->send(response_header, protocol->responseHeaderSize(), onResponseHeaderSent, onResponseHeaderAborted);
+        }
+        else if (response->isQueued()) {
+            sendQueuedResponse();
+        }
+        else {
+            sendStaticResponse();
+        }
     }
 
     void Service::onResponseHeaderAborted(uint8_t *data, uint32_t bytes_sent) {
@@ -235,17 +322,17 @@ namespace WiC64 {
     void Service::onResponseHeaderSent(uint8_t* data, uint32_t size) {
         Data *response = service->response;
 
+        // Only sent separately if the response is empty or the command
+        // does not support queued responses, see sendResponseHeader()
         response->isEmpty()
             ? service->finalizeRequest("Request handled successfully", true)
-            : response->isQueued()
-                ? service->sendQueuedResponse()
-                : service->sendStaticResponse();
+            : service->sendQueuedResponse();
     }
 
     void Service::sendQueuedResponse() {
         Data *response = command->response();
 
-        if (!service->command->supportsQueuedResponse()) {
+        if (!service->command->canStreamResponse(response->size())) {
             ESP_LOGE(TAG, "Command 0x%02x (%s) does not support receiving "
                           "payloads >=64kb when using %s protocol ('%c')",
                 service->command->id(),
@@ -257,59 +344,159 @@ namespace WiC64 {
             return;
         }
 
-        ESP_LOGD(TAG, "Preparing queued send of %d bytes", response->size());
+        previous_segment = 0;
+        current_segment = 0;
+
+        if (response->isFramed()) {
+            ESP_LOGD(TAG, "Preparing framed send of response of unknown length");
+
+            frame_data = NULL;
+            frames_ended = false;
+
+            // The stream ends when the provider returns an empty segment
+            response_header_pending = true;
+            userport->stream(UINT32_MAX, acquireFramedResponseData, onResponseSent, onResponseAborted);
+            return;
+        }
 
+        ESP_LOGD(TAG, "Preparing queued send of %d bytes", response->size());
         bytes_remaining = response->size();
-        items_remaining = WIC64_QUEUE_ITEMS_REQUIRED(response->size());
 
-        service->sendQueuedResponseData();
+        // The header and the queued data are sent as a single continuous
+        // transfer, the userport acquires the next segment while it sends
+        // the current one
+        response_header_pending = true;
+        userport->stream(protocol->responseHeaderSize() + response->size(),
+            acquireQueuedResponseData, onResponseSent, onResponseAborted);
     }
 
-    void Service::sendQueuedResponseData(uint8_t *isSubsequentCall, uint32_t ignoreSize) {
-        Data *response = service->command->response();
+    bool Service::acquireQueuedResponseData(uint8_t **data, uint32_t *size) {
+        Ring *queue = service->command->response()->queue();
+
+        if (service->response_header_pending) {
+            service->response_header_pending = false;
+            *data = service->response_header;
+            *size = service->protocol->responseHeaderSize();
+            return true;
+        }
+
+        ESP_LOGV(TAG, "Acquiring next segment of queued response, %d bytes remaining",
+            service->bytes_remaining);
 
-        vTaskDelay(10);
+        // The userport is still sending the current segment, but it is
+        // done with the one before, so its space can be reused
+        queue->release(service->previous_segment);
+        service->previous_segment = service->current_segment;
 
-        if (isSubsequentCall != NULL) {
-            service->items_remaining--;
+        *size = acquireSegment(queue, data, MIN(service->bytes_remaining, WIC64_QUEUE_SEGMENT_SIZE));
+
+        if (*size == 0) {
+            ESP_LOGW(TAG, "Could not read from response queue in %dms", transferTimeout);
+            return false;
         }
+        service->current_segment = *size;
+        service->bytes_remaining -= *size;
 
-        ESP_LOGV(TAG, "%s call of sendQueuedResponseData(), %d bytes in %d item%s remaining",
-            (isSubsequentCall == NULL) ? "First" : "Subsequent",
-            service->bytes_remaining,
-            service->items_remaining,
-            (service->items_remaining > 1) ? "s" : "");
+        return true;
+    }
 
-        uint32_t size = (service->items_remaining > 1)
-            ? WIC64_QUEUE_ITEM_SIZE
-            : service->bytes_remaining;
+    bool Service::acquireFramedResponseData(uint8_t **data, uint32_t *size) {
+        Ring *queue = service->command->response()->queue();
 
-        if (xQueueReceive(response->queue(), transferQueueReceiveBuffer, pdMS_TO_TICKS(transferTimeout)) != pdTRUE) {
-            ESP_LOGW(TAG, "Could not read next item from response queue in %dms", transferTimeout);
-            onResponseAborted(NULL, service->bytes_remaining);
-            return;
+        if (service->response_header_pending) {
+            service->response_header_pending = false;
+            *data = service->response_header;
+            *size = service->protocol->responseHeaderSize();
+            return true;
+        }
+
+        // Frame headers are not part of the queue, so only data segments
+        // count towards the queue space released here
+        queue->release(service->previous_segment);
+        service->previous_segment = service->current_segment;
+        service->current_segment = 0;
+
+        if (service->frame_data != NULL) {
+            // The header of this frame has been handed out, now the data follows
+            *data = service->frame_data;
+            *size = service->frame_size;
+
+            service->current_segment = service->frame_size;
+            service->frame_data = NULL;
+            return true;
+        }
+
+        if (service->frames_ended) {
+            *data = NULL;
+            *size = 0;
+            return true;
         }
-        service->bytes_remaining -= size;
 
-        (service->items_remaining > 1)
-            ? userport->sendPartial((uint8_t*) transferQueueReceiveBuffer, size, sendQueuedResponseData, onResponseAborted)
-            : userport->send((uint8_t*) transferQueueReceiveBuffer, size, onResponseSent, onResponseAborted);
+        service->frame_size = acquireSegment(queue, &service->frame_data, WIC64_QUEUE_SEGMENT_SIZE);
+
+        if (service->frame_size == 0) {
+            service->frame_data = NULL;
+
+            if (!queue->closed()) {
+                ESP_LOGW(TAG, "Could not read from response queue in %dms", transferTimeout);
+                return false;
+            }
+            ESP_LOGD(TAG, "End of framed response");
+            service->frames_ended = true;
+        }
+
+        ESP_LOGV(TAG, "Sending frame of %d bytes", service->frame_size);
+
+        // The previous frame header has been sent by now, so the
+        // header buffer can be reused
+        service->frame_header[0] = LOWBYTE(service->frame_size);
+        service->frame_header[1] = HIGHBYTE(service->frame_size);
+
+        *data = service->frame_header;
+        *size = sizeof(service->frame_header);
+        return true;
+    }
+
+    uint32_t Service::acquireSegment(Ring *queue, uint8_t **data, uint32_t max) {
+        uint32_t waited = 0;
+        uint32_t size;
+
+        // Waits up to transferTimeout, unless the producer is stalled because
+        // it is reconnecting (see HttpClient::resume()), in which case the
+        // transfer is kept alive until it continues
+        while ((size = queue->acquire(data, max, ACQUIRE_INTERVAL)) == 0 && !queue->closed()) {
+            if (queue->stalled()) {
+                userport->keepAlive();
+                waited = 0;
+            }
+            else if ((waited += ACQUIRE_INTERVAL) >= transferTimeout) {
+                break;
+            }
+        }
+        return size;
     }
 
     void Service::sendStaticResponse(void) {
-        userport->send(response->data(), response->size(), onResponseSent, onResponseAborted);
+        response_segments[0] = { response_header, protocol->responseHeaderSize() };
+        response_segments[1] = { response->data(), response->size() };
+
+        userport->send(response_segments, 2, onResponseSent, onResponseAborted);
     }
 
     void Service::onResponseAborted(uint8_t *data, uint32_t bytes_sent) {
         Data *response = service->command->response();
-        ESP_LOGW(TAG, "Sent %d of %d bytes", bytes_sent, response->size());
+        if (response->isFramed()) {
+            ESP_LOGW(TAG, "Sent %d bytes of framed response", bytes_sent);
+        } else {
+            ESP_LOGW(TAG, "Sent %d of %d bytes", bytes_sent, response->size());
+        }
 
         service->finalizeRequest("Aborted while sending response", false);
     }
 
     void Service::onResponseSent(uint8_t *data, uint32_t size) {
         if (!service->response->isQueued()) {
-            ESP_LOG_HEXV(TAG, "Response", data, size);
+            ESP_LOG_HEXV(TAG, "Response", service->response->data(), service->response->size());
         }
         service->finalizeRequest("Request handled successfully", true);
     }
@@ -323,12 +510,12 @@ namespace WiC64 {
         if (command != NULL) {
             if (request->payload()->isQueued()) {
                 ESP_LOG_LEVEL(ESP_LOG_DEBUG, TAG, "Resetting request queue");
-                xQueueReset(request->payload()->queue());
+                request->payload()->queue()->reset();
             }
 
             if (command->response()->isQueued()) {
                 ESP_LOG_LEVEL(ESP_LOG_DEBUG, TAG, "Resetting response queue");
-                xQueueReset(command->response()->queue());
+                command->response()->queue()->reset();
             }
 
             level = success ? ESP_LOG_DEBUG : ESP_LOG_WARN;
@@ -336,13 +523,23 @@ namespace WiC64 {
 
             delete command;
             command = NULL;
+            prefetcher->leaveForeground();
+
+            // All objects allocated for this request are gone now
+            arena->reset();
+
+            // Responses are only written to flash once they have been sent
+            flashCache->startDeferredStore(success);
         }
         else {
             ESP_LOGE(TAG, "Request has already been finalized: "
                 "firmware bug or protocol violation");
         }
 
-        vTaskDelay(pdMS_TO_TICKS(5));
+        ESP_LOGI(TAG, "Request finalized after %dus, %dus spent waiting for the C64 to turn around",
+            userport->microsSinceRequestInitiated(),
+            userport->microsSpentInTurnaround());
+
         log_free_mem(TAG, ESP_LOG_VERBOSE);
     }
 }
@@ -2,39 +2,43 @@
 #define WIC64_SERVICE_H
 
 #include <cstdint>
-#include "esp_event.h"
 
 #include "protocol.h"
 #include "data.h"
 #include "request.h"
 #include "callback.h"
+#include "dispatcher.h"
+#include "userport.h"
 
-#ifdef ___cplusplus
-extern "C"
-{
-#endif
-
-    ESP_EVENT_DECLARE_BASE(SERVICE_EVENTS);
-
-    enum
-    {
+namespace WiC64 {
+    enum service_event_t {
         SERVICE_RESPONSE_READY,
+        SERVICE_PAYLOAD_PENDING,
+        SERVICE_TURNAROUND_PENDING,
     };
 
-#ifdef ___cplusplus
-}
-#endif
-
-namespace WiC64 {
     class Command;
     class Service {
         public:
             static const char *TAG;
 
         private:
-            esp_event_loop_handle_t event_loop_handle;
+            Dispatcher *m_dispatcher = NULL;
             int32_t bytes_remaining = 0;
-            uint32_t items_remaining = 0;
+            uint32_t previous_segment = 0;
+            uint32_t current_segment = 0;
+
+            uint8_t request_header[Protocol::MAX_REQUEST_HEADER_SIZE];
+            uint8_t response_header[Protocol::MAX_RESPONSE_HEADER_SIZE];
+            bool response_header_pending = false;
+            bool response_compressed = false;
+            bool queue_claimed = false;
+
+            uint8_t frame_header[2];
+            uint8_t *frame_data = NULL;
+            uint32_t frame_size = 0;
+            bool frames_ended = false;
+            segment_t response_segments[2];
 
             Protocol* protocol = NULL;
             Request *request = NULL;
@@ -44,35 +48,41 @@ namespace WiC64 {
         public:
             Service();
 
-            esp_event_loop_handle_t eventLoop() { return event_loop_handle; }
+            Dispatcher *dispatcher() { return m_dispatcher; }
             static void queueTask(void* payload_size_ptr);
 
             void receiveRequest(Protocol* protocol);
             void receiveRequestHeader(Protocol* protocol);
 
             static void onRequestHeaderAborted(uint8_t *header, uint32_t size);
-            static void onRequestHeaderReceived(uint8_t *header, uint32_t size);
+            static bool onRequestHeaderReceived(uint8_t **payload, uint32_t *size);
+            static void onRequestTransferred(uint8_t *data, uint32_t size);
+            static void onPayloadPending(void);
+            static void onTurnaroundPending(void);
 
             void receiveQueuedRequest(void);
             static void receiveQueuedRequestData(uint8_t *data, uint32_t size);
             static void receiveQueuedRequestData() { receiveQueuedRequestData(NULL, 0); }
 
-            void receiveStaticRequest(void);
-
             static void onRequestAborted(uint8_t *data, uint32_t bytes_received);
             static void onRequestReceived(uint8_t *data, uint32_t size);
             void onRequestReceived(void) { onRequestReceived(NULL, 0); }
 
-            static void onResponseReady(void *arg, esp_event_base_t base, int32_t id, void *data);
+            static void onResponseReady(void);
             void sendResponse(void);
 
+            void compressResponse(void);
             void sendResponseHeader(void);
             static void onResponseHeaderAborted(uint8_t *data, uint32_t size);
             static void onResponseHeaderSent(uint8_t *data, uint32_t size);
 
             void sendQueuedResponse(void);
-            static void sendQueuedResponseData(uint8_t *data, uint32_t size);
-            static void sendQueuedResponseData() { sendQueuedResponseData(NULL, 0); }
+            static bool acquireQueuedResponseData(uint8_t **data, uint32_t *size);
+            static bool acquireFramedResponseData(uint8_t **data, uint32_t *size);
+
+            // Queued data is waited for in slices of this length, see acquireSegment()
+            static const uint16_t ACQUIRE_INTERVAL = 100; // ms
+            static uint32_t acquireSegment(Ring *queue, uint8_t **data, uint32_t max);
 
             void sendStaticResponse(void);
 
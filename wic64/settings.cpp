@@ -105,6 +105,16 @@ namespace WiC64 {
         boolean(REBOOTING_KEY, rebooted);
     }
 
+    bool Settings::compressionEnabled(void) {
+        return m_preferences.isKey(COMPRESSION_ENABLED_KEY)
+            ? boolean(COMPRESSION_ENABLED_KEY)
+            : false;
+    }
+
+    void Settings::compressionEnabled(bool compressionEnabled) {
+        boolean(COMPRESSION_ENABLED_KEY, compressionEnabled);
+    }
+
     void Settings::reset(void) {
         if (m_preferences.clear()) {
             ESP_LOGI(TAG, "Erased all settings from flash memory");
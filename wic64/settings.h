@@ -33,6 +33,7 @@ namespace WiC64 {
             const char* USERPORT_DISCONNECTED_KEY = "killswitch";
             const char* REBOOTING_KEY = "rebooting";
             const char* PASSPHRASE_LENGTH_KEY = "passlen";
+            const char* COMPRESSION_ENABLED_KEY = "compression";
 
         public:
             Settings();
@@ -64,6 +65,9 @@ namespace WiC64 {
             bool rebooting(void);
             void rebooting(bool rebooted);
 
+            bool compressionEnabled(void);
+            void compressionEnabled(bool compressionEnabled);
+
             void reset(void);
     };
 }
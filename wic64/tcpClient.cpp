@@ -1,5 +1,6 @@
 #include "wic64.h"
 #include "tcpClient.h"
+#include "resolver.h"
 
 namespace WiC64 {
     const char* TcpClient::TAG = "TCPCLIENT";
@@ -14,12 +15,16 @@ namespace WiC64 {
 
     int TcpClient::open(const char* host, const uint16_t port) {
         bool connected = false;
+        IPAddress address;
+
         if (m_client.connected()) {
             ESP_LOGW(TAG, "Closing previously opened connection");
             close();
         }
 
-        connected = m_client.connect(host, port, 5000);
+        if (resolver->resolve(host, address)) {
+            connected = m_client.connect(address, port, 5000);
+        }
 
         ESP_LOG_LEVEL((connected ? ESP_LOG_INFO : ESP_LOG_ERROR), TAG,
             "%s connection to %s on port %d",
@@ -1,4 +1,5 @@
 #include "driver/gpio.h"
+#include "hal/cpu_hal.h"
 #include "esp32-hal.h"
 #include <cmath>
 
@@ -8,12 +9,67 @@
 #include "led.h"
 #include "utilities.h"
 
-ESP_EVENT_DEFINE_BASE(USERPORT_EVENTS);
+#define WIC64_TABLE_4(F, n)    F(n),                  F((n)+1),                  F((n)+2),                  F((n)+3)
+#define WIC64_TABLE_16(F, n)   WIC64_TABLE_4(F, n),   WIC64_TABLE_4(F, (n)+4),   WIC64_TABLE_4(F, (n)+8),   WIC64_TABLE_4(F, (n)+12)
+#define WIC64_TABLE_64(F, n)   WIC64_TABLE_16(F, n),  WIC64_TABLE_16(F, (n)+16), WIC64_TABLE_16(F, (n)+32), WIC64_TABLE_16(F, (n)+48)
+#define WIC64_TABLE_256(F, n)  WIC64_TABLE_64(F, n),  WIC64_TABLE_64(F, (n)+64), WIC64_TABLE_64(F, (n)+128), WIC64_TABLE_64(F, (n)+192)
+#define WIC64_TABLE_1024(F, n) WIC64_TABLE_256(F, n), WIC64_TABLE_256(F, (n)+256), WIC64_TABLE_256(F, (n)+512), WIC64_TABLE_256(F, (n)+768)
+
+#define WIC64_INPUT_TABLE_ENTRY(n) portValue(((uint32_t) (n)) << PORT_SHIFT)
+#define WIC64_OUTPUT_TABLE_ENTRY(n) portBits((uint8_t) (n))
+
+// Time to busy wait for the C64 during the turnaround
+// before yielding the CPU in Userport::waitUntil()
+#define WIC64_TURNAROUND_SPIN_TIME_US 500
+
+// Additional delay after the C64 has changed the transfer
+// direction before the first handshake is sent to the C64
+#define WIC64_TURNAROUND_GUARD_US 100
+
+// Maximum time to wait for the C64 to read the last byte
+// of a response before the port is switched back to input
+#define WIC64_ACKNOWLEDGE_TIMEOUT 100
+
+#define WIC64_BENCHMARK_ITERATIONS 1024
+#define WIC64_BENCHMARK_TASKS 16
 
 namespace WiC64 {
     const char* Userport::TAG = "USERPORT";
     portMUX_TYPE Userport::mutex = portMUX_INITIALIZER_UNLOCKED;
 
+    constexpr uint8_t Userport::portValue(uint32_t bits) {
+        return (((bits >> PB0) & 1) << 0) |
+               (((bits >> PB1) & 1) << 1) |
+               (((bits >> PB2) & 1) << 2) |
+               (((bits >> PB3) & 1) << 3) |
+               (((bits >> PB4) & 1) << 4) |
+               (((bits >> PB5) & 1) << 5) |
+               (((bits >> PB6) & 1) << 6) |
+               (((bits >> PB7) & 1) << 7);
+    }
+
+    constexpr uint32_t Userport::portBits(uint8_t value) {
+        return ((value & 0x01) ? (1UL<<PB0) : 0) |
+               ((value & 0x02) ? (1UL<<PB1) : 0) |
+               ((value & 0x04) ? (1UL<<PB2) : 0) |
+               ((value & 0x08) ? (1UL<<PB3) : 0) |
+               ((value & 0x10) ? (1UL<<PB4) : 0) |
+               ((value & 0x20) ? (1UL<<PB5) : 0) |
+               ((value & 0x40) ? (1UL<<PB6) : 0) |
+               ((value & 0x80) ? (1UL<<PB7) : 0);
+    }
+
+    // Both tables are accessed from the handshake ISR and
+    // therefore need to be placed in DRAM instead of flash
+
+    DRAM_ATTR const uint8_t Userport::INPUT_TABLE[INPUT_TABLE_SIZE] = {
+        WIC64_TABLE_1024(WIC64_INPUT_TABLE_ENTRY, 0)
+    };
+
+    DRAM_ATTR const uint32_t Userport::OUTPUT_TABLE[256] = {
+        WIC64_TABLE_256(WIC64_OUTPUT_TABLE_ENTRY, 0)
+    };
+
     extern Userport *userport;
     extern Service *service;
     extern Settings *settings;
@@ -25,36 +81,22 @@ namespace WiC64 {
             ESP_INTR_FLAG_LOWMED |
             ESP_INTR_FLAG_LEVEL3);
 
-        esp_event_loop_args_t event_loop_args = {
-            .queue_size = 1,
-            .task_name = TAG,
-            .task_priority = 32,
-            .task_stack_size = 8192,
-            .task_core_id = 0
-        };
-
-        esp_event_loop_create(&event_loop_args, &event_loop_handle);
-
-        esp_event_handler_register_with(
-            event_loop_handle,
-            USERPORT_EVENTS,
-            USERPORT_REQUEST_INITIATED,
-            onRequestInitiated,
-            NULL);
-
-        esp_event_handler_register_with(
-            event_loop_handle,
-            USERPORT_EVENTS,
-            USERPORT_READY_TO_SEND,
-            onReadyToSend,
-            NULL);
-
-        esp_event_handler_register_with(
-            event_loop_handle,
-            USERPORT_EVENTS,
-            USERPORT_TRANSFER_COMPLETED,
-            onTransferCompleted,
-            NULL);
+        // Events are posted from the handshake ISR and dispatched by a
+        // task running at the highest priority available
+        dispatcher = new Dispatcher(TAG, configMAX_PRIORITIES - 1, 8192, 0);
+
+        // The timeout supervisor task is created once and sleeps until a
+        // transfer arms it, see armTimeout() and disarmTimeout()
+        xTaskCreatePinnedToCore(timeoutTask, "TIMEOUT", 4096, NULL, 5, &timeoutTaskHandle, 0);
+
+        if (timeoutTaskHandle == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create timeout supervisor task");
+        }
+
+        dispatcher->on(USERPORT_REQUEST_INITIATED, onRequestInitiated);
+        dispatcher->on(USERPORT_READY_TO_SEND, onReadyToSend);
+        dispatcher->on(USERPORT_TRANSFER_COMPLETED, onTransferCompleted);
+        dispatcher->on(USERPORT_SEGMENT_CONSUMED, onSegmentConsumed);
     }
 
     void Userport::connect() {
@@ -120,8 +162,7 @@ namespace WiC64 {
     }
 
     bool Userport::isInitiallySending(void) {
-        return (transferType == TRANSFER_TYPE_SEND_FULL ||
-                transferType == TRANSFER_TYPE_SEND_PARTIAL) &&
+        return isSending(transferType) &&
                 previousTransferType != TRANSFER_TYPE_SEND_PARTIAL;
     }
 
@@ -131,7 +172,13 @@ namespace WiC64 {
 
     bool Userport::isSending(TRANSFER_TYPE type) {
         return type == TRANSFER_TYPE_SEND_PARTIAL ||
-            type == TRANSFER_TYPE_SEND_FULL;
+            type == TRANSFER_TYPE_SEND_FULL ||
+            type == TRANSFER_TYPE_SEND_STREAM;
+    }
+
+    bool Userport::isStreaming(void) {
+        return transferType == TRANSFER_TYPE_SEND_STREAM ||
+            transferType == TRANSFER_TYPE_RECEIVE_STREAM;
     }
 
     void Userport::setPortToInput() {
@@ -155,6 +202,25 @@ namespace WiC64 {
     }
 
     inline void Userport::readByte(uint8_t *byte) {
+        (*byte) = INPUT_TABLE[(GPIO.in >> PORT_SHIFT) & (INPUT_TABLE_SIZE-1)];
+    }
+
+    inline void Userport::readNextByte() {
+        readByte(buffer+pos);
+        continueTransfer();
+    }
+
+    inline void Userport::writeByte(uint8_t *byte) {
+        register uint32_t bits = OUTPUT_TABLE[*byte];
+        GPIO.out_w1ts = bits;
+        GPIO.out_w1tc = bits ^ PORT_BITS;
+    }
+
+    // The previous implementation of readByte() and writeByte(), which
+    // accesses the GPIO registers once for each pin. Only used to compare
+    // cycle counts in benchmark().
+
+    void Userport::readBytePinByPin(uint8_t *byte) {
         (*byte) = 0;
         IS_HIGH(PB0) && ((*byte) |= 1);
         IS_HIGH(PB1) && ((*byte) |= 2);
@@ -166,12 +232,7 @@ namespace WiC64 {
         IS_HIGH(PB7) && ((*byte) |= 128);
     }
 
-    inline void Userport::readNextByte() {
-        readByte(buffer+pos);
-        continueTransfer();
-    }
-
-    inline void Userport::writeByte(uint8_t *byte) {
+    void Userport::writeBytePinByPin(uint8_t *byte) {
         register uint8_t value = (*byte);
         (value & 1)   ? SET_HIGH(PB0) : SET_LOW(PB0);
         (value & 2)   ? SET_HIGH(PB1) : SET_LOW(PB1);
@@ -207,6 +268,10 @@ namespace WiC64 {
         this->size = size;
         this->pos = 0;
 
+        if (type != TRANSFER_TYPE_SEND_STREAM && type != TRANSFER_TYPE_RECEIVE_STREAM) {
+            streamProvider = NULL;
+        }
+
         transferState = isInitiallySending()
             ? TRANSFER_STATE_PENDING
             : TRANSFER_STATE_RUNNING;
@@ -214,27 +279,67 @@ namespace WiC64 {
         ESP_LOGV(TAG, "%s %d bytes...", isSending(type) ? "Sending" : "Receiving", size);
 
         timeTransferStarted = millis();
-        createTimeoutTask();
+        armTimeout();
 
         if (isInitiallySending()) {
-            ESP_LOGV(TAG, "Sending initial handshake to start pending transfer");
-            vTaskDelay(pdMS_TO_TICKS(1));
-            sendHandshakeSignal(); // first handshake the c64 is waiting for after changing direction
+            if (previousTransferType == TRANSFER_TYPE_RECEIVE_PARTIAL) {
+                // The C64 is still waiting for the handshake for the last
+                // byte it has sent and won't change direction before
+                ESP_LOGV(TAG, "Acknowledging last byte of previous transfer");
+                sendHandshakeSignal();
+            }
+
+            // The dispatcher runs at the highest priority and must not
+            // block while the C64 turns around, the service task waits
+            // in its place, see completeTurnaround()
+
+            if (!isReadyToSend() && dispatcher->isCurrentTask()) {
+                ESP_LOGV(TAG, "Waiting for the C64 to change transfer direction on the service task");
+                service->dispatcher()->post(SERVICE_TURNAROUND_PENDING);
+            } else {
+                completeTurnaround();
+            }
         }
 
         if (type == TRANSFER_TYPE_RECEIVE_PARTIAL ||
-            previousTransferType == TRANSFER_TYPE_RECEIVE_PARTIAL ||
-            previousTransferType == TRANSFER_TYPE_SEND_PARTIAL) {
+            type == TRANSFER_TYPE_RECEIVE_STREAM ||
+            previousTransferType == TRANSFER_TYPE_SEND_PARTIAL ||
+            (previousTransferType == TRANSFER_TYPE_RECEIVE_PARTIAL && !isSending(type))) {
 
+            // The C64 has already written or is about to read the previous
+            // byte and is waiting for this handshake, no need to delay it
             ESP_LOGV(TAG, "Sending initial handshake signal");
-            vTaskDelay(pdMS_TO_TICKS(5));
             sendHandshakeSignal();
         }
     }
 
+    void Userport::completeTurnaround(void) {
+        // The C64 pulls PA2 low once it is ready to receive. Leave it
+        // some additional time to start waiting for the handshake, in
+        // case it still needs to switch its port to input mode.
+
+        if (waitUntil(isReadyToSendCondition, transferTimeout)) {
+            esp_rom_delay_us(WIC64_TURNAROUND_GUARD_US);
+            turnaroundMicros += WIC64_TURNAROUND_GUARD_US;
+        } else {
+            ESP_LOGW(TAG, "C64 did not change transfer direction within %dms", transferTimeout);
+        }
+
+        if (!isTransferPending()) {
+            // The timeout supervisor has aborted the transfer meanwhile
+            return;
+        }
+
+        ESP_LOGV(TAG, "Sending initial handshake to start pending transfer");
+        sendHandshakeSignal(); // first handshake the c64 is waiting for after changing direction
+    }
+
     inline IRAM_ATTR void Userport::continueTransfer(void) {
         if (++pos < size) {
             sendHandshakeSignal();
+        } else if (transferType == TRANSFER_TYPE_SEND_STREAM ||
+                   transferType == TRANSFER_TYPE_RECEIVE_STREAM) {
+            continueStream();
         } else {
             userport->previousTransferType = userport->transferType;
             userport->transferType = TRANSFER_TYPE_NONE;
@@ -242,90 +347,320 @@ namespace WiC64 {
         }
     }
 
-    void Userport::onTransferCompleted(void* arg, esp_event_base_t base, int32_t id, void* data) {
-        TRANSFER_TYPE type = userport->previousTransferType;
+    inline IRAM_ATTR void Userport::continueStream(void) {
+        bool completed = false;
+        bool stalled = false;
 
-        if (type == TRANSFER_TYPE_SEND_FULL || type == TRANSFER_TYPE_RECEIVE_FULL) {
-            userport->sendHandshakeSignal();
+        // The last byte of the current segment has just been written
+        // to or read from the port, swap in the next segment if it is
+        // available
 
-            if (type == TRANSFER_TYPE_RECEIVE_FULL) {
-                vTaskDelay(pdMS_TO_TICKS(1));
+        portENTER_CRITICAL_SAFE(&mutex);
+        streamSent += size;
+
+        if (nextBuffer != NULL) {
+            buffer = nextBuffer;
+            size = nextSize;
+            pos = 0;
+            nextBuffer = NULL;
+        }
+        else if (streamQueued == streamSize) {
+            completed = true;
+        }
+        else {
+            stalled = streamStalled = true;
+        }
+        portEXIT_CRITICAL_SAFE(&mutex);
+
+        if (completed) {
+            userport->previousTransferType = userport->transferType;
+            userport->transferType = TRANSFER_TYPE_NONE;
+            post(USERPORT_TRANSFER_COMPLETED);
+        }
+        else {
+            if (!stalled) {
+                sendHandshakeSignal();
             }
+            // Acquire the next segment, refillStream() resumes
+            // a stalled transfer once it is available
+            post(USERPORT_SEGMENT_CONSUMED);
+        }
+    }
+
+    void Userport::onSegmentConsumed(void) {
+        userport->refillStream();
+    }
+
+    void Userport::refillStream(void) {
+        uint8_t *data;
+        uint32_t length;
+        bool resume, ended;
+
+        while (isStreaming() && streamQueued < streamSize && nextBuffer == NULL) {
+            if (!streamProvider(&data, &length)) {
+                if (isStreaming()) {
+                    abortTransfer("Could not acquire next segment of streamed transfer");
+                }
+                return;
+            }
+
+            portENTER_CRITICAL(&mutex);
+            if (!isStreaming()) {
+                portEXIT_CRITICAL(&mutex);
+                return;
+            }
+            streamQueued += length;
+
+            // A provider returns an empty segment at the end of the
+            // stream, the payload of a streamed receive is always last
+            if (length == 0 || transferType == TRANSFER_TYPE_RECEIVE_STREAM) {
+                streamSize = streamQueued;
+            }
+
+            resume = streamStalled && length > 0;
+            ended = streamStalled && length == 0;
+
+            if (resume) {
+                streamStalled = false;
+                buffer = data;
+                size = length;
+                pos = 0;
+            }
+            else if (ended) {
+                // The handshake for the last byte is still pending. A send
+                // stream completes just as if the ISR had found the end,
+                // a receive stream completes like a partial transfer and
+                // leaves the handshake to the response.
+                streamStalled = false;
+                previousTransferType = (transferType == TRANSFER_TYPE_RECEIVE_STREAM)
+                    ? TRANSFER_TYPE_RECEIVE_PARTIAL
+                    : TRANSFER_TYPE_SEND_STREAM;
+                transferType = TRANSFER_TYPE_NONE;
+            }
+            else if (length > 0) {
+                nextBuffer = data;
+                nextSize = length;
+            }
+            portEXIT_CRITICAL(&mutex);
+
+            if (ended) {
+                post(USERPORT_TRANSFER_COMPLETED);
+                return;
+            }
+
+            if (!resume) {
+                return;
+            }
+
+            // The C64 is still waiting for the handshake for the last
+            // byte of the previous segment, then keep acquiring the
+            // next segment
+            ESP_LOGV(TAG, "Resuming stalled stream after %d bytes", streamSent);
+            sendHandshakeSignal();
+        }
+    }
+
+    void Userport::onTransferCompleted(void) {
+        TRANSFER_TYPE type = userport->previousTransferType;
+        bool sentFull = (type == TRANSFER_TYPE_SEND_FULL || type == TRANSFER_TYPE_SEND_STREAM);
+        bool receivedFull = (type == TRANSFER_TYPE_RECEIVE_FULL || type == TRANSFER_TYPE_RECEIVE_STREAM);
+        uint32_t transferred = (userport->streamProvider != NULL)
+            ? userport->streamSent
+            : userport->size;
+
+        if (sentFull || receivedFull) {
+            // When sending, the C64 strobes PC2 when it reads the last byte.
+            // Let the ISR consume this strobe instead of mistaking it for
+            // the start of a new request, see onHandshakeSignalReceived().
+            userport->awaitingAcknowledge = sentFull;
+            userport->sendHandshakeSignal();
 
             ESP_LOGD(TAG, "Sent final handshake signal");
         }
 
-        userport->deleteTimeoutTask();
+        if (!userport->disarmTimeout()) {
+            ESP_LOGW(TAG, "Transfer completed after it has already timed out");
+            userport->awaitingAcknowledge = false;
+            return;
+        }
         userport->onFailureCallback = NULL;
 
         float sec = (millis() - userport->timeTransferStarted) / 1000.0;
-        float kbs = userport->size/sec/1024;
+        float kbs = transferred/sec/1024;
 
         if (kbs != INFINITY) {
             ESP_LOGI(TAG, "%d bytes %s, transfer completed in %.4f sec, approx. %.2fkb/s",
-            userport->size, userport->isSending(userport->previousTransferType) ? "sent" : "received", sec, kbs);
+            transferred, userport->isSending(userport->previousTransferType) ? "sent" : "received", sec, kbs);
         } else {
             ESP_LOGI(TAG, "%d bytes %s, transfer completed",
-                userport->size, userport->isSending(userport->previousTransferType) ? "sent" : "received");
+                transferred, userport->isSending(userport->previousTransferType) ? "sent" : "received");
         }
 
-        vTaskDelay(pdMS_TO_TICKS(3));
+        if (sentFull) {
+            // Switching the port to input before the C64 has read
+            // the last byte would make it read 0xff instead
+            if (!userport->waitUntil(acknowledgedCondition, WIC64_ACKNOWLEDGE_TIMEOUT)) {
+                ESP_LOGW(TAG, "C64 did not acknowledge last byte within %dms", WIC64_ACKNOWLEDGE_TIMEOUT);
+                userport->awaitingAcknowledge = false;
+            }
+        }
 
         if (userport->previousTransferType != TRANSFER_TYPE_SEND_PARTIAL) {
             userport->setPortToInput();
         }
 
         if (userport->onSuccessCallback != NULL) {
-            userport->onSuccessCallback(userport->buffer, userport->size);
+            userport->onSuccessCallback(userport->buffer, transferred);
         }
     }
 
     void Userport::abortTransfer(const char* reason) {
         ESP_LOGE(TAG, "Aborting transfer: %s", reason);
+        disarmTimeout();
+
         setPortToInput();
 
+        if (isStreaming()) {
+            pos += streamSent;
+        }
+        nextBuffer = NULL;
+        streamStalled = false;
+
         transferType = TRANSFER_TYPE_NONE;
         previousTransferType = TRANSFER_TYPE_NONE;
         transferState = TRANSFER_STATE_NONE;
+        awaitingAcknowledge = false;
 
         if (onFailureCallback != NULL) {
             onFailureCallback(buffer, pos ? pos-1 : 0);
             onFailureCallback = NULL;
         }
-
-        deleteTimeoutTask();
     }
 
-    void Userport::createTimeoutTask(void) {
-        deleteTimeoutTask();
+    String Userport::benchmark(void) {
+        static uint8_t data[WIC64_BENCHMARK_ITERATIONS];
+        uint32_t start, cycles[4];
+        int64_t micros, us[2];
+        TaskHandle_t handle;
+        char report[384];
 
-        xTaskCreatePinnedToCore(timeoutTask, "TIMEOUT", 4096, NULL, 5, &timeoutTaskHandle, 0);
+        if (transferType != TRANSFER_TYPE_NONE || isTransferPending()) {
+            return "Userport busy, benchmark skipped";
+        }
 
-        if (timeoutTaskHandle == NULL) {
-            abortTransfer("Could not create timeout supervisor task");
+        for (uint16_t i=0; i<WIC64_BENCHMARK_ITERATIONS; i++) {
+            data[i] = (uint8_t) i;
         }
-    }
 
-    void Userport::deleteTimeoutTask(void) {
+        // The port remains in input mode, so writing to the output
+        // register has no effect on the lines to the C64
+
         portENTER_CRITICAL(&mutex);
 
-        if (timeoutTaskHandle != NULL) {
-            vTaskDelete(timeoutTaskHandle);
-            timeoutTaskHandle = NULL;
+        start = cpu_hal_get_cycle_count();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_ITERATIONS; i++) readBytePinByPin(data+i);
+        cycles[0] = cpu_hal_get_cycle_count() - start;
+
+        start = cpu_hal_get_cycle_count();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_ITERATIONS; i++) readByte(data+i);
+        cycles[1] = cpu_hal_get_cycle_count() - start;
+
+        start = cpu_hal_get_cycle_count();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_ITERATIONS; i++) writeBytePinByPin(data+i);
+        cycles[2] = cpu_hal_get_cycle_count() - start;
+
+        start = cpu_hal_get_cycle_count();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_ITERATIONS; i++) writeByte(data+i);
+        cycles[3] = cpu_hal_get_cycle_count() - start;
+
+        portEXIT_CRITICAL(&mutex);
+
+        // Compare the cost of supervising a transfer using the persistent
+        // timeout task with creating and deleting a task for each transfer.
+        // A transfer may start meanwhile, so the live supervisor is left
+        // alone and a stand-in task is armed and disarmed the same way.
+
+        micros = esp_timer_get_time();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_TASKS; i++) {
+            xTaskCreatePinnedToCore(benchmarkTask, "BENCHMARK", 4096, NULL, 5, &handle, 0);
+            vTaskDelete(handle);
+        }
+        us[0] = esp_timer_get_time() - micros;
+
+        xTaskCreatePinnedToCore(benchmarkTask, "BENCHMARK", 4096, NULL, 5, &handle, 0);
+
+        micros = esp_timer_get_time();
+        for (uint16_t i=0; i<WIC64_BENCHMARK_TASKS; i++) {
+            benchmarkArmed = true;
+            xTaskNotifyGive(handle);
+
+            portENTER_CRITICAL(&mutex);
+            benchmarkArmed = false;
+            portEXIT_CRITICAL(&mutex);
         }
+        us[1] = esp_timer_get_time() - micros;
+
+        vTaskDelete(handle);
+
+        snprintf(report, sizeof(report),
+            "readByte():  %d cycles/byte (pin by pin: %d, saved: %d)\n"
+            "writeByte(): %d cycles/byte (pin by pin: %d, saved: %d)\n"
+            "Timeout supervision: %lldus/transfer (task per transfer: %lldus, saved: %lldus)",
+            cycles[1] / WIC64_BENCHMARK_ITERATIONS,
+            cycles[0] / WIC64_BENCHMARK_ITERATIONS,
+            ((int32_t) (cycles[0] - cycles[1])) / WIC64_BENCHMARK_ITERATIONS,
+            cycles[3] / WIC64_BENCHMARK_ITERATIONS,
+            cycles[2] / WIC64_BENCHMARK_ITERATIONS,
+            ((int32_t) (cycles[2] - cycles[3])) / WIC64_BENCHMARK_ITERATIONS,
+            us[1] / WIC64_BENCHMARK_TASKS,
+            us[0] / WIC64_BENCHMARK_TASKS,
+            (us[0] - us[1]) / WIC64_BENCHMARK_TASKS);
+
+        ESP_LOGW(TAG, "Benchmark results:\n%s", report);
+        return String(report);
+    }
+
+    void Userport::benchmarkTask(void*) {
+        // Sleeps like timeoutTask() until deleted by benchmark()
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+
+    void Userport::armTimeout(void) {
+        resetTimeout();
+        timeoutArmed = true;
+        xTaskNotifyGive(timeoutTaskHandle);
+    }
+
+    bool Userport::disarmTimeout(void) {
+        bool wasArmed;
 
+        portENTER_CRITICAL(&mutex);
+        wasArmed = timeoutArmed;
+        timeoutArmed = false;
         portEXIT_CRITICAL(&mutex);
+
+        return wasArmed;
     }
 
     void Userport::resetTimeout(void) {
         timeOfLastActivity = esp_timer_get_time() / 1000ULL;
     }
 
+    // Called while the C64 is waiting for data that is known to be
+    // delayed, so that the transfer is not aborted meanwhile
+    void Userport::keepAlive(void) {
+        resetTimeout();
+    }
+
     bool Userport::hasTimedOut(void) {
         return millis() - timeOfLastActivity > transferTimeout;
     }
 
-    void Userport::onRequestInitiated(void* arg, esp_event_base_t base, int32_t event_id, void* data) {
+    void Userport::onRequestInitiated(void) {
+        userport->timeRequestInitiated = esp_timer_get_time();
+        userport->turnaroundMicros = 0;
 
         if (!userport->isReadyToReceive()) {
             userport->handleLineNoise();
@@ -372,7 +707,18 @@ namespace WiC64 {
         startTransfer(TRANSFER_TYPE_RECEIVE_FULL, data, size, onSuccess, onFailure);
     }
 
-    void IRAM_ATTR Userport::onReadyToSend(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    void Userport::receive(uint8_t *header, uint32_t size, provider_t payload, callback_t onSuccess, callback_t onFailure) {
+        streamProvider = payload;
+        streamSize = UINT32_MAX;
+        streamQueued = size;
+        streamSent = 0;
+        streamStalled = false;
+        nextBuffer = NULL;
+
+        startTransfer(TRANSFER_TYPE_RECEIVE_STREAM, header, size, onSuccess, onFailure);
+    }
+
+    void Userport::onReadyToSend(void) {
         ESP_LOGV(TAG, "Received handshake after change of transfer direction");
 
         if (!userport->isReadyToSend()) {
@@ -404,10 +750,87 @@ namespace WiC64 {
         startTransfer(TRANSFER_TYPE_SEND_FULL, data, size, onSuccess, onFailure);
     }
 
+    void Userport::send(segment_t *segments, uint8_t count, callback_t onSuccess, callback_t onFailure) {
+        uint32_t size = 0;
+
+        for (uint8_t i=0; i<count; i++) {
+            size += segments[i].size;
+        }
+
+        this->segments = segments;
+        segmentCount = count;
+        segmentIndex = 0;
+
+        stream(size, acquireNextSegment, onSuccess, onFailure);
+    }
+
+    bool Userport::acquireNextSegment(uint8_t **data, uint32_t *size) {
+        while (userport->segmentIndex < userport->segmentCount &&
+               userport->segments[userport->segmentIndex].size == 0) {
+            userport->segmentIndex++;
+        }
+
+        if (userport->segmentIndex == userport->segmentCount) {
+            *data = NULL;
+            *size = 0;
+            return true;
+        }
+
+        *data = userport->segments[userport->segmentIndex].data;
+        *size = userport->segments[userport->segmentIndex].size;
+        userport->segmentIndex++;
+
+        return true;
+    }
+
+    void Userport::stream(uint32_t size, provider_t provider, callback_t onSuccess, callback_t onFailure) {
+        uint8_t *data, *next;
+        uint32_t length, nextLength;
+
+        streamProvider = provider;
+        streamSize = size;
+        streamSent = 0;
+        streamStalled = false;
+        nextBuffer = NULL;
+
+        // Acquire the first segment and the one after it, so that the
+        // ISR can swap segments right from the start
+
+        if (!provider(&data, &length)) {
+            ESP_LOGE(TAG, "Could not acquire first segment of streamed transfer");
+            if (onFailure != NULL) onFailure(NULL, 0);
+            return;
+        }
+        streamQueued = length;
+
+        if (streamQueued < streamSize) {
+            if (!provider(&next, &nextLength)) {
+                ESP_LOGE(TAG, "Could not acquire second segment of streamed transfer");
+                if (onFailure != NULL) onFailure(NULL, 0);
+                return;
+            }
+            streamQueued += nextLength;
+
+            if (nextLength > 0) {
+                nextBuffer = next;
+                nextSize = nextLength;
+            } else {
+                streamSize = streamQueued;
+            }
+        }
+
+        ESP_LOGD(TAG, "Streaming %d bytes", size);
+        startTransfer(TRANSFER_TYPE_SEND_STREAM, data, length, onSuccess, onFailure);
+    }
+
     void Userport::onHandshakeSignalReceived(void) {
         userport->resetTimeout();
 
-        if (userport->transferState == TRANSFER_STATE_PENDING) {
+        if (userport->awaitingAcknowledge) {
+            userport->awaitingAcknowledge = false;
+        }
+
+        else if (userport->transferState == TRANSFER_STATE_PENDING) {
             userport->post(USERPORT_READY_TO_SEND);
         }
 
@@ -416,15 +839,47 @@ namespace WiC64 {
         }
 
         else if (userport->transferType == TRANSFER_TYPE_RECEIVE_FULL ||
-            userport->transferType == TRANSFER_TYPE_RECEIVE_PARTIAL) {
+            userport->transferType == TRANSFER_TYPE_RECEIVE_PARTIAL ||
+            userport->transferType == TRANSFER_TYPE_RECEIVE_STREAM) {
             userport->readNextByte();
         }
         else if (userport->transferType == TRANSFER_TYPE_SEND_FULL ||
-            userport->transferType == TRANSFER_TYPE_SEND_PARTIAL) {
+            userport->transferType == TRANSFER_TYPE_SEND_PARTIAL ||
+            userport->transferType == TRANSFER_TYPE_SEND_STREAM) {
             userport->writeNextByte();
         }
     }
 
+    bool Userport::isReadyToSendCondition(void) {
+        return userport->isReadyToSend();
+    }
+
+    bool Userport::acknowledgedCondition(void) {
+        return !userport->awaitingAcknowledge;
+    }
+
+    bool Userport::waitUntil(condition_t condition, uint32_t timeout_ms) {
+        int64_t start = esp_timer_get_time();
+        int64_t elapsed = 0;
+        bool fulfilled;
+
+        // The C64 usually responds within a few microseconds, so busy
+        // wait for a short while before falling back to yielding the CPU
+
+        while (!(fulfilled = condition()) && (elapsed = esp_timer_get_time() - start) < timeout_ms * 1000LL) {
+            if (elapsed > WIC64_TURNAROUND_SPIN_TIME_US) {
+                vTaskDelay(1);
+            }
+        }
+
+        turnaroundMicros += esp_timer_get_time() - start;
+        return fulfilled;
+    }
+
+    uint32_t Userport::microsSinceRequestInitiated(void) {
+        return esp_timer_get_time() - timeRequestInitiated;
+    }
+
     void Userport::resetLineNoiseCount(void) {
         lineNoiseCount = 0;
     }
@@ -462,27 +917,34 @@ namespace WiC64 {
     }
 
     inline void IRAM_ATTR Userport::post(userport_event_t event) {
-        BaseType_t task_unblocked;
-
-        esp_event_isr_post_to(
-            userport->event_loop_handle,
-            USERPORT_EVENTS, event,
-            NULL, 0,
-            &task_unblocked);
-
-        if (task_unblocked) {
-            portYIELD_FROM_ISR();
+        if (!userport->dispatcher->post(event)) {
+            ESP_DRAM_LOGE(TAG, "Userport event %d dropped", event);
         }
     }
 
     void Userport::timeoutTask(void* unused) {
-        userport->resetTimeout();
+        bool timedOut;
 
         while(true) {
-            vTaskDelay(pdMS_TO_TICKS(250));
-
-            if (userport->hasTimedOut()) {
-                userport->abortTransfer("Timed out");
+            // Sleep until the next transfer arms the timeout
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            while (userport->timeoutArmed) {
+                // Rearming the timeout for a subsequent transfer
+                // wakes the task early, which is harmless
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(250));
+
+                // Disarm atomically, so that a transfer completing at
+                // the same time will notice it has been aborted
+                portENTER_CRITICAL(&mutex);
+                if ((timedOut = userport->timeoutArmed && userport->hasTimedOut())) {
+                    userport->timeoutArmed = false;
+                }
+                portEXIT_CRITICAL(&mutex);
+
+                if (timedOut) {
+                    userport->abortTransfer("Timed out");
+                }
             }
         }
     }
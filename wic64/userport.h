@@ -5,44 +5,69 @@
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_event.h"
+#include "WString.h"
 #include "callback.h"
 #include "utilities.h"
-
-#ifdef ___cplusplus
-extern "C" {
-#endif
-
-ESP_EVENT_DECLARE_BASE(USERPORT_EVENTS);
+#include "dispatcher.h"
 
 enum userport_event_t {
     USERPORT_REQUEST_INITIATED,
     USERPORT_READY_TO_SEND,
     USERPORT_TRANSFER_COMPLETED,
+    USERPORT_SEGMENT_CONSUMED,
 };
 
-#ifdef ___cplusplus
-}
-#endif
-
 namespace WiC64 {
 
+    // One of several memory areas sent as a single transfer
+    struct segment_t {
+        uint8_t *data;
+        uint32_t size;
+    };
+
     class Userport {
         public: static const char* TAG;
 
         private:
             // Port Register: CIA2 Pin name -> ESP32 pin number
-            const gpio_num_t PB0 = GPIO_NUM_16;
-            const gpio_num_t PB1 = GPIO_NUM_17;
-            const gpio_num_t PB2 = GPIO_NUM_18;
-            const gpio_num_t PB3 = GPIO_NUM_19;
-            const gpio_num_t PB4 = GPIO_NUM_21;
-            const gpio_num_t PB5 = GPIO_NUM_22;
-            const gpio_num_t PB6 = GPIO_NUM_23;
-            const gpio_num_t PB7 = GPIO_NUM_25;
-
-            const uint64_t PORT_MASK = 1ULL<<PB0 | 1ULL<<PB1 | 1ULL<<PB2 | 1ULL<<PB3 |
-                                       1ULL<<PB4 | 1ULL<<PB5 | 1ULL<<PB6 | 1ULL<<PB7;
+            static const gpio_num_t PB0 = GPIO_NUM_16;
+            static const gpio_num_t PB1 = GPIO_NUM_17;
+            static const gpio_num_t PB2 = GPIO_NUM_18;
+            static const gpio_num_t PB3 = GPIO_NUM_19;
+            static const gpio_num_t PB4 = GPIO_NUM_21;
+            static const gpio_num_t PB5 = GPIO_NUM_22;
+            static const gpio_num_t PB6 = GPIO_NUM_23;
+            static const gpio_num_t PB7 = GPIO_NUM_25;
+
+            static const uint64_t PORT_MASK = 1ULL<<PB0 | 1ULL<<PB1 | 1ULL<<PB2 | 1ULL<<PB3 |
+                                              1ULL<<PB4 | 1ULL<<PB5 | 1ULL<<PB6 | 1ULL<<PB7;
+
+            /* Lookup tables translating between port values and GPIO register
+             * bits, generated at compile time from the pin assignments above.
+             *
+             * A byte is read by sampling GPIO.in once and looking up the
+             * bits from PORT_SHIFT to PORT_SHIFT+PORT_WIDTH in INPUT_TABLE.
+             * A byte is written using the set mask from OUTPUT_TABLE and its
+             * complement with regard to PORT_MASK as the clear mask, which
+             * takes exactly one write to GPIO.out_w1ts and GPIO.out_w1tc.
+             */
+            static const uint8_t PORT_SHIFT = MIN(MIN(MIN(PB0, PB1), MIN(PB2, PB3)),
+                                                  MIN(MIN(PB4, PB5), MIN(PB6, PB7)));
+
+            static const uint8_t PORT_WIDTH = MAX(MAX(MAX(PB0, PB1), MAX(PB2, PB3)),
+                                                  MAX(MAX(PB4, PB5), MAX(PB6, PB7))) - PORT_SHIFT + 1;
+
+            static const uint32_t PORT_BITS = (uint32_t) PORT_MASK;
+            static const uint32_t INPUT_TABLE_SIZE = 1024;
+
+            static const uint8_t INPUT_TABLE[INPUT_TABLE_SIZE];
+            static const uint32_t OUTPUT_TABLE[256];
+
+            static constexpr uint8_t portValue(uint32_t bits);
+            static constexpr uint32_t portBits(uint8_t value);
+
+            static_assert(PORT_SHIFT + PORT_WIDTH <= 32, "Port pins must be located within GPIO0..GPIO31");
+            static_assert(PORT_WIDTH <= 10, "Port pins must not span more than 10 GPIOs (see INPUT_TABLE)");
 
             /* Control signals
             *
@@ -74,6 +99,8 @@ namespace WiC64 {
                 TRANSFER_TYPE_SEND_PARTIAL,
                 TRANSFER_TYPE_RECEIVE_FULL,
                 TRANSFER_TYPE_RECEIVE_PARTIAL,
+                TRANSFER_TYPE_SEND_STREAM,
+                TRANSFER_TYPE_RECEIVE_STREAM,
             };
 
             enum TRANSFER_STATE {
@@ -88,9 +115,15 @@ namespace WiC64 {
             volatile uint32_t timeOfLastActivity = 0;
             volatile uint32_t timeTransferStarted = 0;
 
+            volatile bool awaitingAcknowledge = false;
+            int64_t timeRequestInitiated = 0;
+            uint32_t turnaroundMicros = 0;
+
             uint8_t lineNoiseCount = 0;
 
             TaskHandle_t timeoutTaskHandle = NULL;
+            volatile bool timeoutArmed = false;
+            volatile bool benchmarkArmed = false; // stand-in, see benchmark()
 
             volatile TRANSFER_TYPE transferType = TRANSFER_TYPE_NONE;
             volatile TRANSFER_TYPE previousTransferType = TRANSFER_TYPE_NONE;
@@ -103,6 +136,29 @@ namespace WiC64 {
             callback_t onSuccessCallback = NULL;
             callback_t onFailureCallback = NULL;
 
+            /* Streamed transfers: while the ISR transfers the current
+             * segment (buffer, size), the next segment is already waiting
+             * in (nextBuffer, nextSize) and swapped in by the ISR without
+             * interrupting the handshake sequence. If no segment is
+             * available, the ISR stalls the stream until the provider
+             * has acquired the next one, see refillStream().
+             *
+             * Streamed receives only consist of a header and an optional
+             * payload which the provider chooses after the header has
+             * been received.
+             */
+            provider_t streamProvider = NULL;
+            uint8_t *volatile nextBuffer = NULL;
+            volatile uint32_t nextSize = 0;
+            uint32_t streamSize = 0;
+            volatile uint32_t streamQueued = 0;
+            volatile uint32_t streamSent = 0;
+            volatile bool streamStalled = false;
+
+            segment_t *segments = NULL;
+            uint8_t segmentCount = 0;
+            uint8_t segmentIndex = 0;
+
             void setPortToInput(void);
             void setPortToOutput(void);
 
@@ -110,6 +166,9 @@ namespace WiC64 {
             inline IRAM_ATTR void readNextByte(void);
 
             inline void IRAM_ATTR writeByte(uint8_t *byte);
+
+            void readBytePinByPin(uint8_t *byte);
+            void writeBytePinByPin(uint8_t *byte);
             inline void IRAM_ATTR writeFirstByte(void);
             inline void IRAM_ATTR writeNextByte(void);
 
@@ -124,15 +183,26 @@ namespace WiC64 {
             );
 
             inline IRAM_ATTR void continueTransfer(void);
-            static void IRAM_ATTR onTransferCompleted(void* arg, esp_event_base_t base, int32_t id, void* data);
+            inline IRAM_ATTR void continueStream(void);
+            static void onTransferCompleted(void);
+
+            bool isStreaming(void);
+            void refillStream(void);
+            static void onSegmentConsumed(void);
+            static bool acquireNextSegment(uint8_t **data, uint32_t *size);
+
+            void armTimeout(void);
+            bool disarmTimeout(void);
 
-            void createTimeoutTask(void);
-            void deleteTimeoutTask(void);
+            typedef bool (*condition_t)(void);
+            static bool isReadyToSendCondition(void);
+            static bool acknowledgedCondition(void);
+            bool waitUntil(condition_t condition, uint32_t timeout_ms);
 
             static void IRAM_ATTR post(userport_event_t event);
 
         public:
-            esp_event_loop_handle_t event_loop_handle = NULL;
+            Dispatcher *dispatcher = NULL;
 
             Userport();
 
@@ -148,26 +218,38 @@ namespace WiC64 {
             bool isSending(void);
             bool isSending(TRANSFER_TYPE type);
 
-            static void IRAM_ATTR onRequestInitiated(void* arg, esp_event_base_t base, int32_t event_id, void* data);
+            static void onRequestInitiated(void);
 
             void receivePartial(uint8_t *data, uint32_t size, callback_t onSuccess);
             void receivePartial(uint8_t *data, uint32_t size, callback_t onSuccess, callback_t onFailure);
             void receive(uint8_t *data, uint32_t size, callback_t onSuccess);
             void receive(uint8_t *data, uint32_t size, callback_t onSuccess, callback_t onFailure);
+            void receive(uint8_t *header, uint32_t size, provider_t payload, callback_t onSuccess, callback_t onFailure);
 
-            static void IRAM_ATTR onReadyToSend(void* arg, esp_event_base_t base, int32_t id, void* data);
+            static void onReadyToSend(void);
+            void completeTurnaround(void);
 
             void sendPartial(uint8_t *data, uint32_t size, callback_t onSuccess);
             void sendPartial(uint8_t *data, uint32_t size, callback_t onSuccess, callback_t onFailure);
             void send(uint8_t *data, uint32_t size, callback_t onSuccess);
             void send(uint8_t *data, uint32_t size, callback_t onSuccess, callback_t onFailure);
 
+            void send(segment_t *segments, uint8_t count, callback_t onSuccess, callback_t onFailure);
+            void stream(uint32_t size, provider_t provider, callback_t onSuccess, callback_t onFailure);
+
             void abortTransfer(const char* reason);
 
+            String benchmark(void);
+            static void benchmarkTask(void*);
+
             inline void resetTimeout(void);
             inline bool hasTimedOut(void);
+            void keepAlive(void);
             static void timeoutTask(void*);
 
+            uint32_t microsSinceRequestInitiated(void);
+            uint32_t microsSpentInTurnaround(void) { return turnaroundMicros; }
+
             void resetLineNoiseCount(void);
             void handleLineNoise(void);
 
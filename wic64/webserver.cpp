@@ -1,6 +1,18 @@
 #include "webserver.h"
 #include "connection.h"
 #include "settings.h"
+#include "userport.h"
+#include "service.h"
+#include "ring.h"
+#include "buffer.h"
+#include "arena.h"
+#include "worker.h"
+#include "httpClient.h"
+#include "resolver.h"
+#include "lz.h"
+#include "cache.h"
+#include "flashCache.h"
+#include "prefetcher.h"
 #include "utilities.h"
 
 #define WEBSERVER_LOOP_INTERVAL 10
@@ -11,6 +23,10 @@ namespace WiC64 {
     extern Webserver *webserver;
     extern Connection *connection;
     extern Settings *settings;
+    extern Userport *userport;
+    extern Service *service;
+    extern BufferPool *bufferPool;
+    extern HttpClient *httpClient;
 
     Webserver::Webserver() {
         m_arduinoWebServer = new WebServer(80);
@@ -67,6 +83,43 @@ namespace WiC64 {
             return;
         }
 
+        if (server->hasArg("benchmark")) {
+            webserver->reply(
+                webserver->header() +
+                "<pre>" + userport->benchmark() + "\n\n" + Ring::benchmark() + "\n\n" + Lz::benchmark() + "</pre>"
+                "<p><a href='/'>Back</a></p>"
+                + webserver->footer()
+            );
+            return;
+        }
+
+        if (server->hasArg("statistics")) {
+            webserver->reply(
+                webserver->header() +
+                "<pre>" +
+                userport->dispatcher->statistics() + "\n" +
+                service->dispatcher()->statistics() + "\n" +
+                bufferPool->statistics() + "\n" +
+                arena->statistics() + "\n" +
+                workers->statistics() +
+                httpClient->statistics() + "\n" +
+                resolver->statistics() + "\n" +
+                responseCache->statistics() + "\n" +
+                flashCache->statistics() + "\n" +
+                prefetcher->statistics() + "\n" +
+                "</pre>"
+                "<p><a href='/?statistics=1'>Refresh</a> <a href='/'>Back</a></p>"
+                + webserver->footer()
+            );
+            return;
+        }
+
+        if (server->hasArg("compression")) {
+            settings->compressionEnabled(server->arg("compression") == "1");
+            webserver->reloadAndClearQueryString();
+            return;
+        }
+
         if (server->hasArg("factory_reset")) {
             webserver->reloadAndClearQueryString();
             xTaskCreatePinnedToCore(factoryResetTask, "FACTORYRESET", 4096, NULL, 5, NULL, 0);
@@ -89,6 +142,13 @@ namespace WiC64 {
             "<li><a href='/?level=VERBOSE'>VERBOSE</a></li>"
             "</ul>"
 
+            "<p><a href='/?benchmark=1'>Run benchmark</a><br/><small>(measure userport overhead per byte and per transfer, queue throughput and response compression)</small></p>"
+            "<p><a href='/?statistics=1'>Event statistics</a><br/><small>(events and dispatch latency, transfer buffer, request arena and worker stack usage, HTTP connection pool, DNS, response and flash caches, prefetching)</small></p>"
+            "<p>HTTP compression: <strong>" +
+            (settings->compressionEnabled() ? "enabled" : "disabled") +
+            "</strong> <a href='/?compression=" +
+            (settings->compressionEnabled() ? "0'>Disable" : "1'>Enable") +
+            "</a><br/><small>(request gzip/deflate encoded responses and inflate them before sending them to the C64, up to 64kb)</small></p>"
             "<p><a href='/?disconnect=1'>Disconnect WiFi</a><br/><small>(reset ESP to reconnect)</small></p>"
             "<p><a href='/?factory_reset=1'>Factory Reset</a><br/><small>(erase all settings from flash and reset)</small></p>"
             + webserver->footer()
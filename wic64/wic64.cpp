@@ -4,9 +4,17 @@
 #include "connection.h"
 #include "httpClient.h"
 #include "tcpClient.h"
+#include "resolver.h"
+#include "cache.h"
+#include "flashCache.h"
+#include "prefetcher.h"
 #include "webserver.h"
 #include "userport.h"
 #include "service.h"
+#include "ring.h"
+#include "buffer.h"
+#include "arena.h"
+#include "worker.h"
 #include "settings.h"
 #include "clock.h"
 #include "led.h"
@@ -18,6 +26,8 @@
 #include "protocols/extended.h"
 #include "command.h"
 #include "commands/http.h"
+#include "commands/bundle.h"
+#include "commands/prefetch.h"
 #include "commands/scan.h"
 #include "commands/connect.h"
 #include "commands/configured.h"
@@ -41,6 +51,10 @@ namespace WiC64 {
     Service    *service;
     HttpClient *httpClient;
     TcpClient  *tcpClient;
+    Resolver   *resolver;
+    ResponseCache *responseCache;
+    FlashCache *flashCache;
+    Prefetcher *prefetcher;
     Settings   *settings;
     Display    *display;
     Connection *connection;
@@ -51,10 +65,10 @@ namespace WiC64 {
 
     const char* WiC64::TAG = "WIC64";
 
-    uint8_t *transferBuffer;
-    QueueHandle_t transferQueue;
-    uint8_t transferQueueSendBuffer[WIC64_QUEUE_ITEM_SIZE];
-    uint8_t transferQueueReceiveBuffer[WIC64_QUEUE_ITEM_SIZE];
+    BufferPool *bufferPool;
+    Arena *arena;
+    WorkerPool *workers;
+    Ring *transferQueue;
 
     uint32_t transferTimeout = WIC64_DEFAULT_TRANSFER_TIMEOUT;
     uint32_t customTransferTimeout = 0;
@@ -66,26 +80,25 @@ namespace WiC64 {
         loglevel(ESP_LOG_INFO);
         ESP_LOGW(TAG, "Booting Firmware version %s", WIC64_VERSION_STRING);
 
-        transferBuffer = (uint8_t*) calloc(0x10000+1, sizeof(uint8_t));
+        bufferPool = new BufferPool();
+        arena = new Arena();
+        workers = new WorkerPool();
 
-        if (transferBuffer == NULL) {
-            ESP_LOGE(TAG, "Fatal: could not allocate transfer buffer");
-            return;
-        }
+        uint8_t *queueBuffer = (uint8_t*) calloc(WIC64_QUEUE_SIZE, sizeof(uint8_t));
 
-        transferQueue = xQueueCreateStatic(
-            WIC64_QUEUE_SIZE,
-            WIC64_QUEUE_ITEM_SIZE,
-            transferBuffer,
-            &m_staticQueue);
-
-        if (transferQueue == NULL) {
-            ESP_LOGE(TAG, "Fatal: could not allocate transfer buffer");
+        if (queueBuffer == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not allocate transfer queue");
             return;
         }
 
+        transferQueue = new Ring(queueBuffer, WIC64_QUEUE_SIZE);
+
         userport   = new Userport();
         service    = new Service();
+        resolver   = new Resolver();
+        responseCache = new ResponseCache();
+        flashCache = new FlashCache();
+        prefetcher = new Prefetcher();
         httpClient = new HttpClient();
         tcpClient  = new TcpClient();
         settings   = new Settings();
@@ -135,6 +148,8 @@ namespace WiC64 {
         esp_log_level_set(Extended::TAG, loglevel);
         esp_log_level_set(Command::TAG, loglevel);
         esp_log_level_set(Http::TAG, loglevel);
+        esp_log_level_set(Bundle::TAG, loglevel);
+        esp_log_level_set(Prefetch::TAG, loglevel);
         esp_log_level_set(Scan::TAG, loglevel);
         esp_log_level_set(Connect::TAG, loglevel);
         esp_log_level_set(Configured::TAG, loglevel);
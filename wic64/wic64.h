@@ -5,7 +5,6 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 
 #include "../generated-version.h"
 #include "esp_log.h"
@@ -13,45 +12,88 @@
 #define WIC64_DEFAULT_TRANSFER_TIMEOUT 1000
 #define WIC64_DEFAULT_REMOTE_TIMEOUT 5000
 
-#define WIC64_QUEUE_ITEM_SIZE 0x1000
-#define WIC64_QUEUE_SIZE (0x10000 / WIC64_QUEUE_ITEM_SIZE)
+/* Transfer buffers of 65536+1 bytes. This is
+ * the maximum transfer length defined by the
+ * protocol, plus another byte reserved in order
+ * to interpret the data as a null-terminated
+ * c-string. (see Data::c_str()).
+ *
+ * Static request payloads and responses each
+ * hold a buffer from the BufferPool, which keeps
+ * WIC64_BUFFER_POOL_SIZE buffers, see buffer.h.
+ * At most three are in use at the same time: the
+ * request payload, the response and a scratch
+ * buffer for the compressed response. All of them
+ * are released when the request is finalized, a
+ * response stored in flash afterwards is written
+ * from a copy, see FlashCache::deferStore().
+ *
+ * Queued requests and responses are transferred
+ * via the transfer queue instead, a ring of
+ * WIC64_QUEUE_SIZE bytes.
+ *
+ * The reason these buffers are not statically
+ * allocated is that on the esp32, the amount
+ * of statically allocatable memory is limited
+ * due to hard coded memory locations in the
+ * esps roms, so the general advice is to
+ * dynamically allocate large buffers even
+ * though a static allocation would seem the more
+ * appropriate thing to do.
+ *
+ * Since these buffers are allocated early in the
+ * WiC64 constructor and never freed, this will
+ * not contribute to any heap fragmentation.
+ */
+#define WIC64_BUFFER_SIZE (0x10000+1)
+#define WIC64_BUFFER_POOL_SIZE 3
+#define WIC64_QUEUE_SIZE 0x4000
 
-#define WIC64_QUEUE_ITEMS_REQUIRED(size) \
-    (size / WIC64_QUEUE_ITEM_SIZE) + \
-    ((size % WIC64_QUEUE_ITEM_SIZE) ? 1 : 0)
+/* RAM budget on an ESP32 without PSRAM
+ *
+ * Allocated at boot and never freed:
+ *
+ *   transfer buffers     3 x 64kb   192kb  WIC64_BUFFER_POOL_SIZE
+ *   transfer queue                   16kb  WIC64_QUEUE_SIZE
+ *   worker stacks        3 x 8kb     24kb  WIC64_WORKERS
+ *   request arena                     2kb  WIC64_ARENA_SIZE
+ *
+ * Allocated on demand, up to:
+ *
+ *   response cache                   32kb  WIC64_CACHE_MEMORY
+ *   prefetched responses             32kb  WIC64_PREFETCH_MEMORY
+ *   bundle entries                   64kb  during a bundle request
+ *   deferred flash store             64kb  until written to flash
+ *   inflate window                   32kb  during a framed compressed response
+ *   pooled TLS connections  3 x ~25kb      mbedTLS record buffers
+ *
+ * The on-demand users do not fit next to each other at their
+ * limits, so none of them reserves memory up front. A failed
+ * allocation only skips the optional work (caching, prefetching,
+ * storing in flash) or fails the bundle entry or connection
+ * concerned, while the transfer buffers and the queue are
+ * always available to the request being handled. Anything
+ * added to either list has to degrade the same way.
+ */
 
-namespace WiC64 {
+// Maximum number of bytes taken from or added to
+// the transfer queue at once
+#define WIC64_QUEUE_SEGMENT_SIZE 0x1000
 
-    /* Global transfer buffer of 65536+1 bytes. This
-     * is the maximum transfer length defined by the
-     * protocol, plus another byte reserved in order
-     * to interpret the data as a null-terminated
-     * c-string. (see Data::c_str()).
-     *
-     * This buffer is used for incoming requests
-     * as well as outgoing responses, unless the
-     * response is queued. In the latter case the
-     * data is transferred via an RTOS queue of
-     * 16kb.
-     *
-     * The reason this buffer is not statically
-     * allocated is that on the esp32, the amount
-     * of statically allocatable memory is limited
-     * due to hard coded memory locations in the
-     * esps roms, so the general advice is to
-     * dynamically allocate large buffers even
-     * though a static allocation would seem the more
-     * appropriate thing to do.
-     *
-     * Since this buffer is allocated early in the
-     * WiC64 constructor and never freed, this will
-     * not contribute to any heap fragmentation.
-     */
-    extern uint8_t *transferBuffer;
+// Response size reported in the extended protocol
+// header if the response is of unknown length and
+// the client has set Extended::FRAMED_RESPONSE in
+// the request header. The response is then sent as
+// a sequence of frames of
+// a 16 bit little endian length followed by up to
+// WIC64_QUEUE_SEGMENT_SIZE bytes of data, ended by
+// a frame of length zero.
+#define WIC64_FRAMED_RESPONSE_SIZE 0xffffffff
 
-    extern QueueHandle_t transferQueue;
-    extern uint8_t transferQueueSendBuffer[WIC64_QUEUE_ITEM_SIZE];
-    extern uint8_t transferQueueReceiveBuffer[WIC64_QUEUE_ITEM_SIZE];
+namespace WiC64 {
+    class Ring;
+
+    extern Ring *transferQueue;
 
     extern uint32_t transferTimeout;
     extern uint32_t customTransferTimeout;
@@ -60,9 +102,6 @@ namespace WiC64 {
     extern uint32_t customRemoteTimeout;
 
     class WiC64 {
-        private:
-            StaticQueue_t m_staticQueue;
-
         public:
             static const char* TAG;
             static void loglevel(esp_log_level_t level);
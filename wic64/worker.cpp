@@ -0,0 +1,107 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "worker.h"
+
+namespace WiC64 {
+    const char* WorkerPool::TAG = "WORKER";
+
+    WorkerPool::WorkerPool() {
+        char name[configMAX_TASK_NAME_LEN];
+
+        if ((m_queue = xQueueCreate(WIC64_WORKER_QUEUE_SIZE, sizeof(entry_t))) == NULL) {
+            ESP_LOGE(TAG, "Fatal: could not create job queue");
+            return;
+        }
+
+        for (uint8_t i=0; i<WIC64_WORKERS; i++) {
+            snprintf(name, sizeof(name), "WORKER%d", i);
+
+            xTaskCreatePinnedToCore(task, name,
+                WIC64_WORKER_STACK_SIZE,
+                this,
+                WIC64_WORKER_PRIORITY,
+                &m_workers[i], 1);
+
+            if (m_workers[i] == NULL) {
+                ESP_LOGE(TAG, "Fatal: could not create worker task %d", i);
+            }
+        }
+    }
+
+    bool WorkerPool::submit(const char* name, job_t job, void* argument) {
+        entry_t entry = { job, argument, name, esp_timer_get_time() };
+
+        if (m_queue == NULL || xQueueSend(m_queue, &entry, 0) != pdTRUE) {
+            ESP_LOGE(TAG, "Could not submit %s job, all workers busy", name);
+            m_rejected++;
+            return false;
+        }
+
+        ESP_LOGV(TAG, "Submitted %s job", name);
+        m_submitted++;
+        return true;
+    }
+
+    void WorkerPool::task(void* pool) {
+        ((WorkerPool*) pool)->run();
+    }
+
+    void WorkerPool::run(void) {
+        TaskHandle_t self = xTaskGetCurrentTaskHandle();
+        uint8_t index = 0;
+        entry_t entry;
+        uint32_t wait;
+
+        while (true) {
+            if (xQueueReceive(m_queue, &entry, portMAX_DELAY) != pdTRUE) {
+                continue;
+            }
+
+            // The constructor may not have stored this task's handle
+            // yet when the task started, so look it up per job
+            for (index=0; index<WIC64_WORKERS && m_workers[index] != self; index++);
+
+            wait = esp_timer_get_time() - entry.submitted;
+            if (wait > m_maxWait) m_maxWait = wait;
+
+            ESP_LOGV(TAG, "Worker %d running %s job after %dus", index, entry.name, wait);
+
+            if (index < WIC64_WORKERS) m_running[index] = entry.name;
+            entry.job(entry.argument);
+            if (index < WIC64_WORKERS) m_running[index] = NULL;
+
+            m_completed++;
+        }
+    }
+
+    String WorkerPool::statistics(void) {
+        String statistics;
+        char line[120];
+
+        snprintf(line, sizeof(line),
+            "Workers: %d jobs submitted, %d completed, %d rejected, max wait %dus\n",
+            m_submitted,
+            m_completed,
+            m_rejected,
+            m_maxWait);
+
+        statistics += line;
+
+        for (uint8_t i=0; i<WIC64_WORKERS; i++) {
+            if (m_workers[i] == NULL) {
+                continue;
+            }
+
+            snprintf(line, sizeof(line),
+                "  Worker %d: %s, %d of %d stack bytes never used\n",
+                i,
+                m_running[i] != NULL ? m_running[i] : "idle",
+                uxTaskGetStackHighWaterMark(m_workers[i]),
+                WIC64_WORKER_STACK_SIZE);
+
+            statistics += line;
+        }
+        return statistics;
+    }
+}
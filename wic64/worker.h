@@ -0,0 +1,57 @@
+#ifndef WIC64_WORKER_H
+#define WIC64_WORKER_H
+
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "WString.h"
+
+#define WIC64_WORKERS 3
+#define WIC64_WORKER_STACK_SIZE 8192
+#define WIC64_WORKER_PRIORITY 20
+#define WIC64_WORKER_QUEUE_SIZE 8
+
+namespace WiC64 {
+
+    /* Small pool of persistent tasks that run jobs taken from a queue,
+     * used for work that has to run off the event loop, such as queued
+     * commands and reading large HTTP responses into the transfer queue.
+     * Jobs are short-lived and must not delete the task they run on.
+     */
+    class WorkerPool {
+        public:
+            static const char* TAG;
+            typedef void (*job_t)(void* argument);
+
+        private:
+            typedef struct {
+                job_t job;
+                void* argument;
+                const char* name;
+                int64_t submitted;
+            } entry_t;
+
+            QueueHandle_t m_queue = NULL;
+            TaskHandle_t m_workers[WIC64_WORKERS] = { NULL };
+            const char* m_running[WIC64_WORKERS] = { NULL };
+
+            uint32_t m_submitted = 0;
+            uint32_t m_completed = 0;
+            uint32_t m_rejected = 0;
+            uint32_t m_maxWait = 0;
+
+            static void task(void* pool);
+            void run(void);
+
+        public:
+            WorkerPool();
+
+            bool submit(const char* name, job_t job, void* argument);
+            String statistics(void);
+    };
+
+    extern WorkerPool *workers;
+}
+
+#endif // WIC64_WORKER_H